@@ -0,0 +1,13 @@
+#include <linux/blk-mq.h>
+
+static bool test_busy_iter(struct request *req, void *data, bool reserved)
+{
+	return true;
+}
+
+int main(void)
+{
+	blk_mq_tagset_busy_iter(NULL, test_busy_iter, NULL);
+
+	return 0;
+}
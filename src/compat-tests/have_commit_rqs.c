@@ -0,0 +1,14 @@
+#include <linux/blk-mq.h>
+
+static void test_commit_rqs(struct blk_mq_hw_ctx *hctx)
+{
+}
+
+int main(void)
+{
+	struct blk_mq_ops ops;
+
+	ops.commit_rqs = test_commit_rqs;
+
+	return 0;
+}
@@ -0,0 +1,11 @@
+#include <linux/eventfd.h>
+
+int main(void)
+{
+	struct eventfd_ctx *ctx = NULL;
+	__u64 cnt;
+
+	eventfd_ctx_do_read(ctx, &cnt);
+
+	return 0;
+}
@@ -0,0 +1,10 @@
+#include <linux/eventfd.h>
+
+int main(void)
+{
+	struct eventfd_ctx *ctx = NULL;
+
+	eventfd_signal(ctx);
+
+	return 0;
+}
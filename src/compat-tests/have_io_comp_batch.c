@@ -0,0 +1,10 @@
+#include <linux/blk-mq.h>
+
+int main(void)
+{
+	DEFINE_IO_COMP_BATCH(iob);
+
+	blk_mq_end_request_batch(&iob);
+
+	return 0;
+}
@@ -0,0 +1,14 @@
+#include <linux/blk-mq.h>
+
+static void test_map_queues(struct blk_mq_tag_set *set)
+{
+}
+
+int main(void)
+{
+	struct blk_mq_ops ops;
+
+	ops.map_queues = test_map_queues;
+
+	return 0;
+}
@@ -0,0 +1,10 @@
+#include <linux/blk-mq.h>
+
+int main(void)
+{
+	struct blk_mq_ops ops;
+
+	ops.queue_rqs = NULL;
+
+	return 0;
+}
@@ -0,0 +1,10 @@
+#include <linux/shrinker.h>
+
+int main(void)
+{
+	struct shrinker shrinker = { 0 };
+
+	register_shrinker(&shrinker, "test%d", 0);
+
+	return 0;
+}
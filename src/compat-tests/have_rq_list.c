@@ -0,0 +1,14 @@
+#include <linux/blk-mq.h>
+
+static void test_queue_rqs(struct rq_list *rqlist)
+{
+}
+
+int main(void)
+{
+	struct blk_mq_ops ops;
+
+	ops.queue_rqs = test_queue_rqs;
+
+	return 0;
+}
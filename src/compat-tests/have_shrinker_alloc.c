@@ -0,0 +1,12 @@
+#include <linux/shrinker.h>
+
+int main(void)
+{
+	struct shrinker *shrinker;
+
+	shrinker = shrinker_alloc(0, "test");
+	shrinker_register(shrinker);
+	shrinker_free(shrinker);
+
+	return 0;
+}
@@ -0,0 +1,29 @@
+#include <linux/fs.h>
+#include <linux/io_uring/cmd.h>
+
+static void test_task_cb(struct io_uring_cmd *cmd, unsigned int issue_flags)
+{
+	io_uring_cmd_done(cmd, 0, 0, issue_flags);
+}
+
+static int test_uring_cmd(struct io_uring_cmd *cmd, unsigned int issue_flags)
+{
+	const void *payload = io_uring_sqe_cmd(cmd->sqe);
+
+	if (issue_flags & IO_URING_F_CANCEL)
+		return 0;
+
+	io_uring_cmd_mark_cancelable(cmd, issue_flags);
+	io_uring_cmd_complete_in_task(cmd, test_task_cb);
+
+	return -EIOCBQUEUED;
+}
+
+int main(void)
+{
+	struct file_operations fops;
+
+	fops.uring_cmd = test_uring_cmd;
+
+	return 0;
+}
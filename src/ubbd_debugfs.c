@@ -82,11 +82,36 @@ static int ubbd_q_status_show(struct seq_file *file, void *ignored)
 {
 	struct ubbd_queue *ubbd_q = file->private;
 
+	seq_printf(file, "numa_node:			%12d\n\n", ubbd_q->numa_node);
+
 	seq_printf(file,
 		   "data_pages:			%12u\n"
 		   "data_pages_reserved:	%12d\n"
-		   "data_pages_allocated:	%12d\n",
-		   ubbd_q->data_pages, ubbd_q->data_pages_reserved, ubbd_q->data_pages_allocated);
+		   "data_pages_allocated:	%12d\n"
+		   "data_pages_reclaimed:	%12lld\n"
+		   "data_unmaps:		%12lld\n",
+		   ubbd_q->data_pages, ubbd_q->data_pages_reserved,
+		   atomic_read(&ubbd_q->data_pages_allocated),
+		   atomic64_read(&ubbd_q->data_pages_reclaimed),
+		   atomic64_read(&ubbd_q->data_unmaps));
+	seq_puts(file, "\n");
+
+	seq_printf(file,
+		   "notify_delivered:		%12llu\n"
+		   "notify_suppressed:		%12llu\n"
+		   "completed:			%12llu\n"
+		   "complete_kicks:		%12lld\n",
+		   ubbd_q->notify_delivered, ubbd_q->notify_suppressed,
+		   ubbd_q->completed, atomic64_read(&ubbd_q->complete_kicks));
+	seq_puts(file, "\n");
+
+	seq_printf(file,
+		   "cmdr_full:			%12lld\n"
+		   "data_full:			%12lld\n"
+		   "res_stops:			%12lld\n",
+		   atomic64_read(&ubbd_q->cmdr_full),
+		   atomic64_read(&ubbd_q->data_full),
+		   atomic64_read(&ubbd_q->res_stops));
 	seq_puts(file, "\n");
 
 	return 0;
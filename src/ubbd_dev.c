@@ -54,28 +54,133 @@ static int ubbd_init_hctx(struct blk_mq_hw_ctx *hctx, void *driver_data,
 
 static const struct blk_mq_ops ubbd_mq_ops = {
 	.queue_rq	= ubbd_queue_rq,
+#ifdef HAVE_COMMIT_RQS
+	.commit_rqs	= ubbd_commit_rqs,
+#endif /* HAVE_COMMIT_RQS */
+#ifdef HAVE_QUEUE_RQS
+	.queue_rqs	= ubbd_queue_rqs,
+#endif /* HAVE_QUEUE_RQS */
+#ifdef HAVE_IO_COMP_BATCH
+	.map_queues	= ubbd_map_queues,
+	.poll		= ubbd_poll,
+#endif /* HAVE_IO_COMP_BATCH */
 	.timeout	= ubbd_timeout,
 	.init_hctx	= ubbd_init_hctx,
 };
 
+/* the largest SE a request can need, see UBBD_SLOT_IOV_MAX */
+static u32 ubbd_se_size_max(u64 dev_features, u32 inline_data_max)
+{
+	size_t iov_size = (dev_features & UBBD_ATTR_FLAGS_ADD_COMPACT_SE) ?
+		sizeof(struct ubbd_se_extent) : sizeof(struct iovec);
+
+	return round_up(sizeof(struct ubbd_se) +
+			max_t(size_t, UBBD_SLOT_IOV_MAX * iov_size, inline_data_max),
+			UBBD_OP_ALIGN_SIZE);
+}
+
+/*
+ * page aligned ring of slot indexes in front of the slots, with one
+ * more entry than there can be slots.
+ */
+static u32 ubbd_slot_index_size(u32 cmdr_size, u32 slot_size)
+{
+	return round_up((cmdr_size / (slot_size + sizeof(u32)) + 1) * sizeof(u32), PAGE_SIZE);
+}
+
+/*
+ * Number of worst-case SEs that always fit in a cmd ring of cmdr_size
+ * bytes. The byte ring keeps CMDR_RESERVED unused and can lose up to one
+ * SE to UBBD_OP_PAD at its end.
+ */
+u32 ubbd_cmdr_se_capacity(u32 cmdr_size, u64 dev_features, u32 inline_data_max)
+{
+	u32 se_size = ubbd_se_size_max(dev_features, inline_data_max);
+	u32 index_size;
+
+	if (dev_features & UBBD_ATTR_FLAGS_ADD_SLOT_RING) {
+		index_size = ubbd_slot_index_size(cmdr_size, se_size);
+		if (cmdr_size <= index_size)
+			return 0;
+
+		return (cmdr_size - index_size) / se_size;
+	}
+
+	if (cmdr_size <= CMDR_RESERVED + se_size)
+		return 0;
+
+	return (cmdr_size - CMDR_RESERVED) / se_size - 1;
+}
+
+/*
+ * Split the cmd ring area into a ring of u32 slot indexes and the SE
+ * slots behind it, page aligned. cmdr_size becomes the size of the
+ * index ring. It has nr_slots + 1 entries: with all slots submitted
+ * cmd_head stops one entry short of cmd_tail, so a full ring never
+ * looks empty.
+ */
+static void ubbd_queue_slot_ring_init(struct ubbd_queue *ubbd_q)
+{
+	struct ubbd_device *ubbd_dev = ubbd_q->ubbd_dev;
+	struct ubbd_sb *sb = ubbd_q->sb_addr;
+	u32 index_size;
+
+	ubbd_q->slot_size = ubbd_se_size_max(ubbd_dev->dev_features,
+			ubbd_dev->inline_data_max);
+	index_size = ubbd_slot_index_size(ubbd_dev->cmdr_size, ubbd_q->slot_size);
+	ubbd_q->nr_slots = (ubbd_dev->cmdr_size - index_size) / ubbd_q->slot_size;
+	ubbd_q->slots = ubbd_q->cmdr + index_size;
+
+	sb->flags |= UBBD_SB_F_SLOT_RING;
+	sb->cmdr_size = (ubbd_q->nr_slots + 1) * sizeof(u32);
+	ubbd_q->sb_ext->slot_off = CMDR_OFF + index_size;
+	ubbd_q->sb_ext->slot_size = ubbd_q->slot_size;
+	ubbd_q->sb_ext->nr_slots = ubbd_q->nr_slots;
+}
+
+/*
+ * Move the ring indexes behind sb_ext in the info area, one
+ * UBBD_SB_IDX_STRIDE each.
+ */
+static void ubbd_queue_split_idx_init(struct ubbd_queue *ubbd_q)
+{
+	struct ubbd_sb *sb = ubbd_q->sb_addr;
+	u32 idx_off = UBBD_INFO_OFF + round_up(sizeof(struct ubbd_sb_ext), UBBD_SB_IDX_STRIDE);
+	void *idx = (void *)sb + idx_off;
+
+	BUILD_BUG_ON(round_up(sizeof(struct ubbd_sb_ext), UBBD_SB_IDX_STRIDE) +
+			UBBD_SB_IDX_NR * UBBD_SB_IDX_STRIDE > UBBD_INFO_SIZE);
+
+	ubbd_q->sb_cmd_head = idx + UBBD_SB_IDX_CMD_HEAD * UBBD_SB_IDX_STRIDE;
+	ubbd_q->sb_cmd_tail = idx + UBBD_SB_IDX_CMD_TAIL * UBBD_SB_IDX_STRIDE;
+	ubbd_q->sb_compr_head = idx + UBBD_SB_IDX_COMPR_HEAD * UBBD_SB_IDX_STRIDE;
+	ubbd_q->sb_compr_tail = idx + UBBD_SB_IDX_COMPR_TAIL * UBBD_SB_IDX_STRIDE;
+
+	sb->flags |= UBBD_SB_F_SPLIT_IDX;
+	ubbd_q->sb_ext->idx_off = idx_off;
+}
+
 static int ubbd_queue_sb_init(struct ubbd_queue *ubbd_q)
 {
+	struct ubbd_device *ubbd_dev = ubbd_q->ubbd_dev;
+	u32 compr_off = CMDR_OFF + ubbd_dev->cmdr_size;
+	u32 ring_size = compr_off + ubbd_dev->compr_size;
 	struct ubbd_sb *sb;
 
 	if (ubbd_mgmt_need_fault()) {
 		return -ENOMEM;
 	}
 
-	sb = vzalloc(RING_SIZE);
+	sb = vzalloc_node(ring_size, ubbd_q->numa_node);
 	if (!sb) {
 		return -ENOMEM;
 	}
 
 	ubbd_q->sb_addr = sb;
 	ubbd_q->cmdr = (void *)sb + CMDR_OFF;
-	ubbd_q->compr = (void *)sb + COMPR_OFF;
-	ubbd_q->data_off = RING_SIZE;
-	ubbd_q->mmap_pages = (ubbd_q->data_pages + (RING_SIZE >> PAGE_SHIFT));
+	ubbd_q->compr = (void *)sb + compr_off;
+	ubbd_q->data_off = ring_size;
+	ubbd_q->mmap_pages = (ubbd_q->data_pages + (ring_size >> PAGE_SHIFT));
 
 	/* Initialise the sb of the ring buffer */
 	sb->magic = UBBD_MAGIC;
@@ -83,9 +188,34 @@ static int ubbd_queue_sb_init(struct ubbd_queue *ubbd_q)
 	sb->info_off = UBBD_INFO_OFF;
 	sb->info_size = UBBD_INFO_SIZE;
 	sb->cmdr_off = CMDR_OFF;
-	sb->cmdr_size = CMDR_SIZE;
-	sb->compr_off = COMPR_OFF;
-	sb->compr_size = COMPR_SIZE;
+	sb->cmdr_size = ubbd_dev->cmdr_size;
+	sb->compr_off = compr_off;
+	sb->compr_size = ubbd_dev->compr_size;
+
+	BUILD_BUG_ON(sizeof(struct ubbd_sb_ext) > UBBD_INFO_SIZE);
+	ubbd_q->sb_ext = (void *)sb + UBBD_INFO_OFF;
+	ubbd_q->sb_ext->magic = UBBD_SB_EXT_MAGIC;
+	ubbd_q->sb_ext->inline_data_max = ubbd_q->ubbd_dev->inline_data_max;
+
+	ubbd_q->sb_cmd_head = &sb->cmd_head;
+	ubbd_q->sb_cmd_tail = &sb->cmd_tail;
+	ubbd_q->sb_compr_head = &sb->compr_head;
+	ubbd_q->sb_compr_tail = &sb->compr_tail;
+	if (ubbd_dev_split_idx(ubbd_q->ubbd_dev))
+		ubbd_queue_split_idx_init(ubbd_q);
+
+	if (ubbd_dev_compact_se(ubbd_q->ubbd_dev))
+		sb->flags |= UBBD_SB_F_COMPACT_SE;
+
+	if (ubbd_dev_slot_ring(ubbd_q->ubbd_dev))
+		ubbd_queue_slot_ring_init(ubbd_q);
+	/*
+	 * only a complete thread clears it, while it is awake. write() does
+	 * nothing for a poll queue, ubbd_poll() reaps its completions.
+	 */
+	if (!ubbd_queue_is_poll(ubbd_q))
+		ubbd_q->sb_ext->kflags = UBBD_SB_EXT_KF_NEED_WAKEUP;
+
 	ubbd_dev_debug(ubbd_q->ubbd_dev, "info_off: %u, info_size: %u, cmdr_off: %u, cmdr_size: %u, \
 			compr_off: %u, compr_size: %u, data_off: %lu",
 			sb->info_off, sb->info_size, sb->cmdr_off,
@@ -103,13 +233,58 @@ static void ubbd_queue_sb_destroy(struct ubbd_queue *ubbd_q)
 static void ubbd_page_release(struct ubbd_queue *ubbd_q);
 static void ubbd_queue_destroy(struct ubbd_queue *ubbd_q)
 {
+	ubbd_queue_kring_stop(ubbd_q);
+	if (ubbd_q->complete_thread)
+		kthread_stop(ubbd_q->complete_thread);
+	if (ubbd_q->complete_work.func)
+		cancel_work_sync(&ubbd_q->complete_work);
+
 	ubbd_queue_kring_destroy(ubbd_q);
 	ubbd_queue_sb_destroy(ubbd_q);
 
-	if (ubbd_q->data_bitmap) {
+	if (ubbd_q->data_sbq.sb.map) {
 		ubbd_page_release(ubbd_q);
 		xa_destroy(&ubbd_q->data_pages_array);
-		bitmap_free(ubbd_q->data_bitmap);
+	}
+	sbitmap_queue_free(&ubbd_q->data_sbq);
+	sbitmap_queue_free(&ubbd_q->cmd_slots);
+	if (ubbd_q->page_pool)
+		cancel_work_sync(&ubbd_q->pool_refill_work);
+	mempool_destroy(ubbd_q->page_pool);
+	kfree(ubbd_q->data_ref);
+	kfree(ubbd_q->data_reclaim);
+}
+
+/* mempool_alloc_pages() would refill the pool from the current node */
+static void *ubbd_pool_alloc_page(gfp_t gfp, void *pool_data)
+{
+	struct ubbd_queue *ubbd_q = pool_data;
+
+	return alloc_pages_node(ubbd_q->numa_node, gfp, 0);
+}
+
+static void ubbd_pool_free_page(void *element, void *pool_data)
+{
+	__free_page(element);
+}
+
+/*
+ * Pages the GFP_NOIO retry took from page_pool stay cached in their
+ * slots, put fresh ones back so the next retry finds a full reserve.
+ */
+static void ubbd_queue_pool_refill_fn(struct work_struct *work)
+{
+	struct ubbd_queue *ubbd_q = container_of(work, struct ubbd_queue, pool_refill_work);
+	mempool_t *pool = ubbd_q->page_pool;
+	struct page *page;
+
+	while (READ_ONCE(pool->curr_nr) < pool->min_nr) {
+		page = alloc_pages_node(ubbd_q->numa_node, GFP_NOIO, 0);
+		if (!page)
+			break;
+
+		/* frees the page if the pool filled up meanwhile */
+		mempool_free(page, pool);
 	}
 }
 
@@ -118,17 +293,42 @@ static int ubbd_queue_create(struct ubbd_queue *ubbd_q, u32 data_pages)
 	int ret;
 
 	ubbd_q->data_pages = data_pages;
-	ubbd_q->data_pages_reserved = \
-		ubbd_q->data_pages * UBBD_KRING_DATA_RESERVE_PERCENT / 100;
+	/* the shrinker may take back everything else */
+	if (ubbd_dev_prealloc(ubbd_q->ubbd_dev))
+		ubbd_q->data_pages_reserved = \
+			ubbd_q->data_pages * UBBD_KRING_DATA_RESERVE_PERCENT / 100;
+	else
+		ubbd_q->data_pages_reserved = 0;
 
 	if (ubbd_mgmt_need_fault())
 		return -ENOMEM;
 
 	xa_init(&ubbd_q->data_pages_array);
+	mutex_init(&ubbd_q->state_lock);
+	init_waitqueue_head(&ubbd_q->cmd_wait);
+	spin_lock_init(&ubbd_q->fetch_lock);
+	INIT_LIST_HEAD(&ubbd_q->fetch_cmds);
+	spin_lock_init(&ubbd_q->prealloc_lock);
+	INIT_LIST_HEAD(&ubbd_q->prealloc_pages);
+
+	ret = sbitmap_queue_init_node(&ubbd_q->data_sbq, ubbd_q->data_pages,
+			-1, false, GFP_KERNEL, ubbd_q->numa_node);
+	if (ret) {
+		return ret;
+	}
 
-	ubbd_q->data_bitmap = bitmap_zalloc(ubbd_q->data_pages, GFP_KERNEL);
-	if (!ubbd_q->data_bitmap) {
-		return -ENOMEM;
+	ubbd_q->data_ref = kcalloc_node(BITS_TO_LONGS(ubbd_q->data_pages),
+			sizeof(unsigned long), GFP_KERNEL, ubbd_q->numa_node);
+	if (!ubbd_q->data_ref) {
+		ret = -ENOMEM;
+		goto err;
+	}
+
+	ubbd_q->data_reclaim = kcalloc_node(BITS_TO_LONGS(ubbd_q->data_pages),
+			sizeof(unsigned long), GFP_KERNEL, ubbd_q->numa_node);
+	if (!ubbd_q->data_reclaim) {
+		ret = -ENOMEM;
+		goto err;
 	}
 
 	ret = ubbd_queue_sb_init(ubbd_q);
@@ -137,28 +337,123 @@ static int ubbd_queue_create(struct ubbd_queue *ubbd_q, u32 data_pages)
 		goto err;
 	}
 
+	/* enough pages for one request of UBBD_SLOT_IOV_MAX segments */
+	if (ubbd_dev_prealloc(ubbd_q->ubbd_dev)) {
+		ubbd_q->page_pool = mempool_create_node(UBBD_SLOT_IOV_MAX,
+				ubbd_pool_alloc_page, ubbd_pool_free_page, ubbd_q,
+				GFP_KERNEL, ubbd_q->numa_node);
+		if (!ubbd_q->page_pool) {
+			ubbd_dev_err(ubbd_q->ubbd_dev, "failed to create page pool.");
+			ret = -ENOMEM;
+			goto err;
+		}
+		INIT_WORK(&ubbd_q->pool_refill_work, ubbd_queue_pool_refill_fn);
+	}
+
+	if (ubbd_q->nr_slots) {
+		ret = sbitmap_queue_init_node(&ubbd_q->cmd_slots, ubbd_q->nr_slots,
+				-1, false, GFP_KERNEL, ubbd_q->numa_node);
+		if (ret) {
+			ubbd_dev_err(ubbd_q->ubbd_dev, "failed to init cmd slots: %d.", ret);
+			goto err;
+		}
+	}
+
 	ret = ubbd_queue_kring_init(ubbd_q);
 	if (ret) {
 		ubbd_dev_err(ubbd_q->ubbd_dev, "failed to init kring: %d.", ret);
 		goto err;
 	}
 
-	mutex_init(&ubbd_q->state_lock);
-	INIT_LIST_HEAD(&ubbd_q->inflight_reqs);
-	spin_lock_init(&ubbd_q->inflight_reqs_lock);
 	spin_lock_init(&ubbd_q->cmdr_lock);
 	spin_lock_init(&ubbd_q->compr_lock);
 	mutex_init(&ubbd_q->pages_mutex);
-	ubbd_q->req_tid = 0;
+	ubbd_q->req_gen = 0;
+	atomic_set(&ubbd_q->inflight, 0);
+	ubbd_q->notify_delivered = 0;
+	ubbd_q->notify_suppressed = 0;
+	ubbd_q->completed = 0;
+	atomic64_set(&ubbd_q->complete_kicks, 0);
+	atomic64_set(&ubbd_q->cmdr_full, 0);
+	atomic64_set(&ubbd_q->data_full, 0);
+	atomic64_set(&ubbd_q->res_stops, 0);
+	atomic_set(&ubbd_q->res_seq, 0);
+	atomic64_set(&ubbd_q->data_pages_reclaimed, 0);
+	atomic64_set(&ubbd_q->data_unmaps, 0);
 	INIT_WORK(&ubbd_q->complete_work, complete_work_fn);
 	cpumask_clear(&ubbd_q->cpumask);
+	ubbd_q->submit_cpu = raw_smp_processor_id();
 	atomic_set(&ubbd_q->status, UBBD_QUEUE_KSTATUS_RUNNING);
 
+	if (ubbd_q->ubbd_dev->complete_ctx == UBBD_COMPLETE_CTX_KTHREAD &&
+			!ubbd_queue_is_poll(ubbd_q)) {
+		struct task_struct *thread;
+
+		/* bound to the queue's cpus in ubbd_init_queue_cpumask() */
+		thread = kthread_run(ubbd_complete_thread_fn, ubbd_q, "ubbd%d-c%d",
+				ubbd_q->ubbd_dev->dev_id, ubbd_q->index);
+		if (IS_ERR(thread)) {
+			ret = PTR_ERR(thread);
+			ubbd_dev_err(ubbd_q->ubbd_dev, "failed to run complete thread: %d.", ret);
+			goto err;
+		}
+		ubbd_q->complete_thread = thread;
+	}
+
 	return 0;
 err:
 	return ret;
 }
 
+/*
+ * Allocate data_pages_reserved pages up front. sbitmap hands out slots
+ * from per-cpu hints, so we can't tell which slots will be used: the
+ * pages wait on prealloc_pages and ubbd_alloc_page() gives each one to
+ * the first slot that needs a page. Not in zerocopy mode, which never
+ * caches pages.
+ */
+static void ubbd_queue_prealloc_fn(struct work_struct *work)
+{
+	struct ubbd_queue *ubbd_q = container_of(work, struct ubbd_queue, prealloc_work);
+	struct page *page;
+	u32 i;
+
+	for (i = 0; i < ubbd_q->data_pages_reserved; i++) {
+		page = alloc_pages_node(ubbd_q->numa_node, GFP_KERNEL, 0);
+		if (!page)
+			goto err;
+
+		spin_lock(&ubbd_q->prealloc_lock);
+		list_add_tail(&page->lru, &ubbd_q->prealloc_pages);
+		spin_unlock(&ubbd_q->prealloc_lock);
+		cond_resched();
+	}
+
+	return;
+err:
+	ubbd_q->prealloc_ret = -ENOMEM;
+}
+
+/* one work per queue, so large devices don't fill their queues one by one */
+static int ubbd_dev_prealloc_pages(struct ubbd_device *ubbd_dev)
+{
+	int i;
+	int ret = 0;
+
+	for (i = 0; i < ubbd_dev->num_queues; i++) {
+		INIT_WORK(&ubbd_dev->queues[i].prealloc_work, ubbd_queue_prealloc_fn);
+		queue_work(system_unbound_wq, &ubbd_dev->queues[i].prealloc_work);
+	}
+
+	for (i = 0; i < ubbd_dev->num_queues; i++) {
+		flush_work(&ubbd_dev->queues[i].prealloc_work);
+		if (ubbd_dev->queues[i].prealloc_ret)
+			ret = ubbd_dev->queues[i].prealloc_ret;
+	}
+
+	return ret;
+}
+
 static void ubbd_dev_destroy_queues(struct ubbd_device *ubbd_dev)
 {
 	int i;
@@ -170,6 +465,47 @@ static void ubbd_dev_destroy_queues(struct ubbd_device *ubbd_dev)
 	kfree(ubbd_dev->queues);
 }
 
+/*
+ * The home node of a queue is the node of the first cpu blk-mq maps to
+ * it, the same one blk_mq_hw_queue_to_node() gives its hctx. The tag set
+ * doesn't exist yet, so run the mapping of ubbd_map_queues() on a
+ * scratch map.
+ */
+static int ubbd_dev_init_queue_nodes(struct ubbd_device *ubbd_dev)
+{
+	struct blk_mq_queue_map qmap = { 0 };
+	unsigned int nr_queues[] = {
+		ubbd_dev->num_queues - ubbd_dev->num_poll_queues,
+		ubbd_dev->num_poll_queues,
+	};
+	struct ubbd_queue *ubbd_q;
+	int i, cpu;
+
+	qmap.mq_map = kcalloc(nr_cpu_ids, sizeof(unsigned int), GFP_KERNEL);
+	if (!qmap.mq_map)
+		return -ENOMEM;
+
+	for (i = 0; i < ubbd_dev->num_queues; i++)
+		ubbd_dev->queues[i].numa_node = NUMA_NO_NODE;
+
+	for (i = 0; i < ARRAY_SIZE(nr_queues); i++) {
+		if (!nr_queues[i])
+			continue;
+
+		qmap.nr_queues = nr_queues[i];
+		blk_mq_map_queues(&qmap);
+		for_each_possible_cpu(cpu) {
+			ubbd_q = &ubbd_dev->queues[qmap.mq_map[cpu]];
+			if (ubbd_q->numa_node == NUMA_NO_NODE)
+				ubbd_q->numa_node = cpu_to_node(cpu);
+		}
+		qmap.queue_offset += nr_queues[i];
+	}
+	kfree(qmap.mq_map);
+
+	return 0;
+}
+
 static int ubbd_dev_create_queues(struct ubbd_device *ubbd_dev, int num_queues, u32 data_pages)
 {
 	int i;
@@ -182,6 +518,12 @@ static int ubbd_dev_create_queues(struct ubbd_device *ubbd_dev, int num_queues,
 		return -ENOMEM;
 	}
 
+	ret = ubbd_dev_init_queue_nodes(ubbd_dev);
+	if (ret) {
+		kfree(ubbd_dev->queues);
+		return ret;
+	}
+
 	for (i = 0; i < num_queues; i++) {
 		ubbd_q = &ubbd_dev->queues[i];
 		ubbd_q->ubbd_dev = ubbd_dev;
@@ -191,6 +533,14 @@ static int ubbd_dev_create_queues(struct ubbd_device *ubbd_dev, int num_queues,
 			goto err;
 	}
 
+	if (ubbd_dev_prealloc(ubbd_dev) && !ubbd_dev_zerocopy(ubbd_dev)) {
+		ret = ubbd_dev_prealloc_pages(ubbd_dev);
+		if (ret) {
+			ubbd_dev_err(ubbd_dev, "failed to preallocate data pages: %d.", ret);
+			goto err;
+		}
+	}
+
 	return 0;
 err:
 	ubbd_dev_destroy_queues(ubbd_dev);
@@ -242,7 +592,7 @@ static void __ubbd_dev_free(struct ubbd_device *ubbd_dev)
 static void ubbd_page_release(struct ubbd_queue *ubbd_q)
 {
 	XA_STATE(xas, &ubbd_q->data_pages_array, 0);
-	struct page *page;
+	struct page *page, *tmp;
 
 	xas_lock(&xas);
 	xas_for_each(&xas, page, ubbd_q->data_pages) {
@@ -250,6 +600,11 @@ static void ubbd_page_release(struct ubbd_queue *ubbd_q)
 		__free_page(page);
 	}
 	xas_unlock(&xas);
+
+	list_for_each_entry_safe(page, tmp, &ubbd_q->prealloc_pages, lru) {
+		list_del(&page->lru);
+		__free_page(page);
+	}
 }
 
 static struct ubbd_device *ubbd_dev_create(struct ubbd_dev_add_opts *add_opts)
@@ -264,6 +619,16 @@ static struct ubbd_device *ubbd_dev_create(struct ubbd_dev_add_opts *add_opts)
 	if (ubbd_mgmt_need_fault())
 		goto fail_ubbd_dev;
 
+	/* the queues' sb layout depends on them */
+	ubbd_dev->dev_features = add_opts->dev_features;
+	ubbd_dev->complete_ctx = add_opts->complete_ctx;
+	ubbd_dev->complete_poll_us = add_opts->complete_poll_us;
+	ubbd_dev->inline_data_max = add_opts->inline_data_max;
+	ubbd_dev->cmdr_size = add_opts->cmdr_size;
+	ubbd_dev->compr_size = add_opts->compr_size;
+	ubbd_dev->queue_depth = add_opts->queue_depth;
+	ubbd_dev->num_poll_queues = add_opts->poll_queues;
+
         ubbd_dev->dev_id = ida_alloc_range(&ubbd_dev_id_ida, 0,
                                          minor_to_ubbd_dev_id(1 << MINORBITS) - 1,
                                          GFP_KERNEL);
@@ -272,7 +637,8 @@ static struct ubbd_device *ubbd_dev_create(struct ubbd_dev_add_opts *add_opts)
 
 	sprintf(ubbd_dev->name, UBBD_DRV_NAME "%d", ubbd_dev->dev_id);
 
-	ret = ubbd_dev_create_queues(ubbd_dev, add_opts->num_queues, add_opts->data_pages);
+	ret = ubbd_dev_create_queues(ubbd_dev, add_opts->num_queues + add_opts->poll_queues,
+			add_opts->data_pages);
 	if (ret)
 		goto err_remove_id;
 
@@ -281,6 +647,12 @@ static struct ubbd_device *ubbd_dev_create(struct ubbd_dev_add_opts *add_opts)
 		goto err_destroy_queues;
 	}
 
+	/* zerocopy devices don't cache data pages */
+	if (!ubbd_dev_zerocopy(ubbd_dev) && ubbd_dev_shrinker_init(ubbd_dev)) {
+		ubbd_dev_err(ubbd_dev, "failed to register shrinker.");
+		goto err_destroy_wq;
+	}
+
 	__module_get(THIS_MODULE);
 	ubbd_debugfs_add_dev(ubbd_dev);
 
@@ -288,6 +660,8 @@ static struct ubbd_device *ubbd_dev_create(struct ubbd_dev_add_opts *add_opts)
 
 	return ubbd_dev;
 
+err_destroy_wq:
+	destroy_workqueue(ubbd_dev->task_wq);
 err_destroy_queues:
 	ubbd_dev_destroy_queues(ubbd_dev);
 err_remove_id:
@@ -300,6 +674,7 @@ fail_ubbd_dev:
 void ubbd_dev_destroy(struct ubbd_device *ubbd_dev)
 {
 	ubbd_debugfs_remove_dev(ubbd_dev);
+	ubbd_dev_shrinker_exit(ubbd_dev);
 	destroy_workqueue(ubbd_dev->task_wq);
 	ubbd_dev_destroy_queues(ubbd_dev);
         ida_free(&ubbd_dev_id_ida, ubbd_dev->dev_id);
@@ -310,12 +685,24 @@ void ubbd_dev_destroy(struct ubbd_device *ubbd_dev)
 static void ubbd_init_queue_cpumask(struct ubbd_device *ubbd_dev, struct blk_mq_tag_set *tag_set)
 {
 	struct ubbd_queue *ubbd_q;
-	int cpu;
-	unsigned int *map = tag_set->map[HCTX_TYPE_DEFAULT].mq_map;
+	int cpu, i;
+	unsigned int *map;
+
+	for (i = 0; i < tag_set->nr_maps; i++) {
+		if (!tag_set->map[i].nr_queues)
+			continue;
 
-	for_each_present_cpu(cpu) {
-		ubbd_q = &ubbd_dev->queues[map[cpu]];
-		cpumask_set_cpu(cpu, &ubbd_q->cpumask);
+		map = tag_set->map[i].mq_map;
+		for_each_present_cpu(cpu) {
+			ubbd_q = &ubbd_dev->queues[map[cpu]];
+			cpumask_set_cpu(cpu, &ubbd_q->cpumask);
+		}
+	}
+
+	for (cpu = 0; cpu < ubbd_dev->num_queues; cpu++) {
+		ubbd_q = &ubbd_dev->queues[cpu];
+		if (ubbd_q->complete_thread && !cpumask_empty(&ubbd_q->cpumask))
+			set_cpus_allowed_ptr(ubbd_q->complete_thread, &ubbd_q->cpumask);
 	}
 }
 
@@ -357,13 +744,18 @@ static int ubbd_init_disk(struct ubbd_device *ubbd_dev)
 
 	memset(&ubbd_dev->tag_set, 0, sizeof(ubbd_dev->tag_set));
 	ubbd_dev->tag_set.ops = &ubbd_mq_ops;
-	ubbd_dev->tag_set.queue_depth = 128;
+	ubbd_dev->tag_set.queue_depth = ubbd_dev->queue_depth;
+	/* per-hctx request PDUs follow blk_mq_hw_queue_to_node() */
 	ubbd_dev->tag_set.numa_node = NUMA_NO_NODE;
         ubbd_dev->tag_set.flags = 0;
 #ifdef BLK_MQ_F_SHOULD_MERGE
         ubbd_dev->tag_set.flags |= BLK_MQ_F_SHOULD_MERGE;
 #endif
 	ubbd_dev->tag_set.nr_hw_queues = ubbd_dev->num_queues;
+#ifdef HAVE_IO_COMP_BATCH
+	if (ubbd_dev->num_poll_queues)
+		ubbd_dev->tag_set.nr_maps = HCTX_MAX_TYPES;
+#endif /* HAVE_IO_COMP_BATCH */
 	ubbd_dev->tag_set.cmd_size = sizeof(struct ubbd_request);
 	ubbd_dev->tag_set.timeout = ubbd_dev->io_timeout * HZ;
 	ubbd_dev->tag_set.driver_data = ubbd_dev;
@@ -469,13 +861,18 @@ static int ubbd_init_disk(struct ubbd_device *ubbd_dev)
 
         memset(&ubbd_dev->tag_set, 0, sizeof(ubbd_dev->tag_set));
 	ubbd_dev->tag_set.ops = &ubbd_mq_ops;
-	ubbd_dev->tag_set.queue_depth = 128;
+	ubbd_dev->tag_set.queue_depth = ubbd_dev->queue_depth;
+	/* per-hctx request PDUs follow blk_mq_hw_queue_to_node() */
 	ubbd_dev->tag_set.numa_node = NUMA_NO_NODE;
         ubbd_dev->tag_set.flags = 0;
 #ifdef BLK_MQ_F_SHOULD_MERGE
         ubbd_dev->tag_set.flags |= BLK_MQ_F_SHOULD_MERGE;
 #endif
 	ubbd_dev->tag_set.nr_hw_queues = ubbd_dev->num_queues;
+#ifdef HAVE_IO_COMP_BATCH
+	if (ubbd_dev->num_poll_queues)
+		ubbd_dev->tag_set.nr_maps = HCTX_MAX_TYPES;
+#endif /* HAVE_IO_COMP_BATCH */
 	ubbd_dev->tag_set.cmd_size = sizeof(struct ubbd_request);
 	ubbd_dev->tag_set.timeout = ubbd_dev->io_timeout * HZ;
 	ubbd_dev->tag_set.driver_data = ubbd_dev;
@@ -738,7 +1135,6 @@ struct ubbd_device *ubbd_dev_add_dev(struct ubbd_dev_add_opts *add_opts)
 	}
 
 	ubbd_dev->dev_size = add_opts->device_size;
-	ubbd_dev->dev_features = add_opts->dev_features;
 	ubbd_dev->io_timeout = add_opts->io_timeout;
 
 	ret = ubbd_dev_device_setup(ubbd_dev);
@@ -781,6 +1177,8 @@ int ubbd_dev_remove_dev(struct ubbd_device *ubbd_dev)
 	list_del_init(&ubbd_dev->dev_node);
 	mutex_unlock(&ubbd_dev_list_mutex);
 
+	/* the shrinker restarts hctxs of the disk */
+	ubbd_dev_shrinker_exit(ubbd_dev);
 	ubbd_free_disk(ubbd_dev);
 	mutex_unlock(&ubbd_dev->state_lock);
 	ubbd_dev_put(ubbd_dev);
@@ -832,12 +1230,19 @@ out:
 	return ret;
 }
 
-static struct ubbd_queue *find_running_queue(struct ubbd_device *ubbd_dev)
+/*
+ * Nobody polls a poll queue for requests of a default hctx, so only a
+ * poll queue can take over the hctx of another poll queue.
+ */
+static struct ubbd_queue *find_running_queue(struct ubbd_device *ubbd_dev, bool poll)
 {
 	int i;
 	struct ubbd_queue *ubbd_q = NULL;
 
 	for (i = 0; i < ubbd_dev->num_queues; i++) {
+		if (!poll && ubbd_queue_is_poll(&ubbd_dev->queues[i]))
+			continue;
+
 		if (atomic_read(&ubbd_dev->queues[i].status) == UBBD_QUEUE_KSTATUS_RUNNING) {
 			ubbd_q = &ubbd_dev->queues[i];
 			break;
@@ -847,6 +1252,20 @@ static struct ubbd_queue *find_running_queue(struct ubbd_device *ubbd_dev)
 	return ubbd_q;
 }
 
+/*
+ * Wait for the submissions that may still see the old queue status.
+ * They run inline in ubbd_queue_rq() and fall back to task_wq, so
+ * quiesce the request queue before flushing task_wq.
+ */
+static void ubbd_dev_sync_submit(struct ubbd_device *ubbd_dev)
+{
+	if (ubbd_dev->disk) {
+		blk_mq_quiesce_queue(ubbd_dev->disk->queue);
+		blk_mq_unquiesce_queue(ubbd_dev->disk->queue);
+	}
+	flush_workqueue(ubbd_dev->task_wq);
+}
+
 static int queue_stop(struct ubbd_device *ubbd_dev, struct ubbd_queue *ubbd_q)
 {
 	struct blk_mq_hw_ctx *hctx;
@@ -869,19 +1288,26 @@ static int queue_stop(struct ubbd_device *ubbd_dev, struct ubbd_queue *ubbd_q)
 
 	hctx = ubbd_q->mq_hctx;	
 	if (hctx) {
-		running_q = find_running_queue(ubbd_dev);
+		running_q = find_running_queue(ubbd_dev, ubbd_queue_is_poll(ubbd_q));
 		if (running_q)
 			hctx->driver_data = running_q;
 	}
 
 	atomic_set(&ubbd_q->status, UBBD_QUEUE_KSTATUS_STOPPING);
-	flush_workqueue(ubbd_dev->task_wq);
-
-	spin_lock(&ubbd_q->inflight_reqs_lock);
-	if (list_empty(&ubbd_q->inflight_reqs)) {
-		atomic_set(&ubbd_q->status, UBBD_QUEUE_KSTATUS_STOPPED);
+	ubbd_dev_sync_submit(ubbd_dev);
+	/* a batch may have been committed on the queue we switched to */
+	ubbd_queue_commit(ubbd_q);
+
+	/*
+	 * pairs with the atomic_dec_and_test() in ubbd_queue_inflight_dec(),
+	 * either we see no inflight request or the last completion sees
+	 * the STOPPING status.
+	 */
+	smp_mb();
+	if (!atomic_read(&ubbd_q->inflight)) {
+		atomic_cmpxchg(&ubbd_q->status, UBBD_QUEUE_KSTATUS_STOPPING,
+				UBBD_QUEUE_KSTATUS_STOPPED);
 	}
-	spin_unlock(&ubbd_q->inflight_reqs_lock);
 
 out:
 	mutex_unlock(&ubbd_q->state_lock);
@@ -980,13 +1406,15 @@ static void ubbd_dev_remove_queues(struct ubbd_device *ubbd_dev, bool force)
 		atomic_set(&ubbd_q->status, UBBD_QUEUE_KSTATUS_REMOVING);
 		mutex_unlock(&ubbd_q->state_lock);
 		/*
-		 * flush the task_wq, to avoid race with complete_work.
+		 * wait for submissions and flush the task_wq, to avoid race
+		 * with complete_work.
 		 *
-		 * after the flush_workqueue, all other work will return
-		 * directly as UBBD_QUEUE_KSTATUS_REMOVING is already set.
+		 * after that, all other work will return directly as
+		 * UBBD_QUEUE_KSTATUS_REMOVING is already set.
 		 * Then we can end the inflight requests safely.
 		 * */
-		flush_workqueue(ubbd_dev->task_wq);
+		ubbd_dev_sync_submit(ubbd_dev);
+		flush_work(&ubbd_q->complete_work);
 		if (force) {
 			ubbd_queue_end_inflight_reqs(ubbd_q, -EIO);
 		}
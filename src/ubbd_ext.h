@@ -0,0 +1,250 @@
+#ifndef UBBD_EXT_H
+#define UBBD_EXT_H
+
+#include <linux/ioctl.h>
+
+/*
+ * Extensions to the userspace interface in ubbd.h.
+ *
+ * Everything here is shared with the backend and the management tool,
+ * so it follows the same rules as ubbd.h: never renumber, only append.
+ * Feature flags for UBBD_ATTR_FLAGS in UBBD_CMD_ADD_DEV start at bit 32
+ * to stay clear of the flags defined in ubbd.h.
+ */
+
+/*
+ * map bio pages into the data area instead of copying into private pages.
+ * Only page cache pages qualify: O_DIRECT IO from anonymous user buffers
+ * still goes through bounce pages.
+ */
+#define UBBD_ATTR_FLAGS_ADD_ZEROCOPY		(1ULL << 32)
+/* fixed-size SE slots instead of a byte ring, see UBBD_SB_F_SLOT_RING */
+#define UBBD_ATTR_FLAGS_ADD_SLOT_RING		(1ULL << 33)
+/* struct ubbd_se_extent instead of struct iovec, see UBBD_SB_F_COMPACT_SE */
+#define UBBD_ATTR_FLAGS_ADD_COMPACT_SE		(1ULL << 34)
+/* ring indexes on separate cache lines, see UBBD_SB_F_SPLIT_IDX */
+#define UBBD_ATTR_FLAGS_ADD_SPLIT_IDX		(1ULL << 35)
+/*
+ * allocate the reserved data pages when the device is added, and keep a
+ * page mempool per queue for a max-size request under memory pressure
+ */
+#define UBBD_ATTR_FLAGS_ADD_PREALLOC		(1ULL << 36)
+
+/*
+ * sb->flags set by the kernel, starting at the top bit to stay clear of
+ * ubbd.h.
+ *
+ * UBBD_SB_F_SLOT_RING: the cmd ring holds u32 slot indexes, cmd_head and
+ * cmdr_size still count bytes of it. Each index names one of the
+ * nr_slots SEs of slot_size bytes at slot_off in struct ubbd_sb_ext. A
+ * slot is reused once its CE is reaped, in any order, so there is no
+ * UBBD_OP_PAD and the kernel doesn't maintain cmd_tail.
+ */
+#define UBBD_SB_F_SLOT_RING			(1U << 15)
+
+/*
+ * UBBD_SB_F_COMPACT_SE: the iov[] of a data SE holds iov_cnt struct
+ * ubbd_se_extent, not struct iovec, and the SE length shrinks to match.
+ */
+#define UBBD_SB_F_COMPACT_SE			(1U << 14)
+
+/*
+ * UBBD_SB_F_SPLIT_IDX: cmd_head, cmd_tail, compr_head and compr_tail in
+ * struct ubbd_sb are unused. Each of them lives in its own
+ * UBBD_SB_IDX_STRIDE bytes at sb_ext->idx_off + UBBD_SB_IDX_* *
+ * UBBD_SB_IDX_STRIDE from the sb, so the indexes written by the kernel
+ * and the one written by the backend don't share a cache line.
+ */
+#define UBBD_SB_F_SPLIT_IDX			(1U << 13)
+
+enum {
+	UBBD_SB_IDX_CMD_HEAD,
+	UBBD_SB_IDX_CMD_TAIL,
+	UBBD_SB_IDX_COMPR_HEAD,
+	UBBD_SB_IDX_COMPR_TAIL,
+	UBBD_SB_IDX_NR,
+};
+
+/* two lines, so adjacent-line prefetch doesn't pair them up either */
+#define UBBD_SB_IDX_STRIDE			128
+
+/*
+ * len bytes starting at offset in data page page_index, i.e. at
+ * sb + data_off + page_index * PAGE_SIZE + offset, and running on
+ * through the following pages. Adjacent pages of a request are merged
+ * into one extent as long as len fits.
+ */
+struct ubbd_se_extent {
+	__u32	page_index;
+	__u16	offset;
+	__u16	len;
+};
+
+/* UBBD_ATTR_DEV_OPTS for UBBD_CMD_ADD_DEV, continuing the ones in ubbd.h */
+enum {
+	UBBD_DEV_OPTS_COMPLETE_CTX = UBBD_DEV_OPTS_MAX + 1,	/* u32, enum ubbd_complete_ctx */
+	UBBD_DEV_OPTS_POLL_QUEUES,	/* u32, poll queues on top of UBBD_DEV_OPTS_DEV_QUEUES */
+	UBBD_DEV_OPTS_COMPLETE_POLL_US,	/* u32, complete thread busy-polls this long before sleeping */
+	UBBD_DEV_OPTS_INLINE_DATA_MAX,	/* u32, reads and writes up to this many bytes use UBBD_SE_HDR_INLINE_DATA */
+	UBBD_DEV_OPTS_CMDR_SIZE,	/* u32, bytes of each cmd ring, page aligned */
+	UBBD_DEV_OPTS_COMPR_SIZE,	/* u32, bytes of each completion ring, page aligned */
+	UBBD_DEV_OPTS_QUEUE_DEPTH,	/* u32, blk-mq tags per queue */
+	__UBBD_DEV_OPTS_EXT_MAX,
+};
+#define UBBD_DEV_OPTS_EXT_MAX (__UBBD_DEV_OPTS_EXT_MAX - 1)
+
+/* where completions are processed once the backend writes to the kring */
+enum ubbd_complete_ctx {
+	UBBD_COMPLETE_CTX_INLINE,	/* in the backend's write(), the default */
+	UBBD_COMPLETE_CTX_KTHREAD,	/* in a per-queue kthread bound to the queue's cpus,
+					 * polling compr_head for UBBD_DEV_OPTS_COMPLETE_POLL_US */
+	UBBD_COMPLETE_CTX_SUBMIT_CPU,	/* in a work item on the cpu that submitted last */
+	__UBBD_COMPLETE_CTX_MAX,
+};
+
+/* UBBD_QUEUE_INFO_ITEM attributes, continuing the ones in ubbd.h */
+enum {
+	/*
+	 * flag, the queue is a poll queue: its completions are reaped by the
+	 * block layer polling it, write() on its kring doesn't complete them.
+	 */
+	UBBD_QUEUE_INFO_POLL = UBBD_QUEUE_INFO_MAX + 1,
+	/*
+	 * s32, the node the queue's sb and data pages are allocated on, or
+	 * -1. Backends pin their threads for the queue to it.
+	 */
+	UBBD_QUEUE_INFO_NUMA_NODE,
+	__UBBD_QUEUE_INFO_EXT_MAX,
+};
+#define UBBD_QUEUE_INFO_EXT_MAX (__UBBD_QUEUE_INFO_EXT_MAX - 1)
+
+/* upper bound of UBBD_DEV_OPTS_COMPLETE_POLL_US */
+#define UBBD_COMPLETE_POLL_US_MAX		(1000 * 1000)
+
+/* upper bound of UBBD_DEV_OPTS_INLINE_DATA_MAX */
+#define UBBD_INLINE_DATA_MAX			4096
+
+/*
+ * upper bounds of UBBD_DEV_OPTS_CMDR_SIZE, UBBD_DEV_OPTS_COMPR_SIZE and
+ * UBBD_DEV_OPTS_QUEUE_DEPTH. UBBD_CMD_ADD_DEV also fails unless the cmd
+ * ring holds queue_depth SEs of the largest size and the completion ring
+ * more than queue_depth CEs.
+ */
+#define UBBD_RING_SIZE_MAX			(256 * 1024 * 1024)
+#define UBBD_QUEUE_DEPTH_MAX			4096
+
+/*
+ * se->header.flags, starting at the top bit to stay clear of ubbd.h.
+ *
+ * UBBD_SE_HDR_INLINE_DATA: the SE carries no iov, its se->len bytes of
+ * data sit in the SE itself, right after struct ubbd_se. The kernel fills
+ * them for a write. For a read the backend writes them there before it
+ * posts the CE, the SE stays in place until the CE is reaped.
+ */
+#define UBBD_SE_HDR_INLINE_DATA			(1U << 31)
+
+/*
+ * Extension of struct ubbd_sb, placed in the info area at sb->info_off.
+ * Older kernels leave the info area zeroed, so the backend must check
+ * magic before trusting any other field.
+ */
+struct ubbd_sb_ext {
+	__u32	magic;		/* UBBD_SB_EXT_MAGIC */
+	__u32	kflags;		/* UBBD_SB_EXT_KF_*, written by the kernel only */
+	__u32	bflags;		/* UBBD_SB_EXT_BF_*, written by the backend only */
+	__u32	cmd_event;	/* cmdr offset, see UBBD_SB_EXT_BF_CMD_EVENT */
+	__u32	slot_off;	/* from the sb, UBBD_SB_F_SLOT_RING only */
+	__u32	slot_size;
+	__u32	nr_slots;
+	__u32	inline_data_max;	/* UBBD_DEV_OPTS_INLINE_DATA_MAX, 0 if disabled */
+	__u32	idx_off;		/* from the sb, UBBD_SB_F_SPLIT_IDX only */
+};
+
+#define UBBD_SB_EXT_MAGIC			0x75626578	/* "ubex" */
+
+/*
+ * Nobody is polling compr_head, the backend has to write() to the kring
+ * after publishing completions. Cleared while the complete thread of a
+ * UBBD_COMPLETE_CTX_KTHREAD device is running, which lets the backend
+ * skip the syscall. The backend must read it after its store to
+ * compr_head with a full barrier in between.
+ */
+#define UBBD_SB_EXT_KF_NEED_WAKEUP		(1U << 0)
+
+/*
+ * The backend polls cmd_head, the kernel doesn't notify the kring for new
+ * SEs. The backend must clear it, issue a full barrier and check cmd_head
+ * again before it goes to sleep in poll() or read().
+ */
+#define UBBD_SB_EXT_BF_POLLING			(1U << 0)
+
+/*
+ * The kernel only notifies the kring when it publishes the SE at offset
+ * cmd_event, usually the cmd_tail the backend stopped at. Same barrier
+ * rule as UBBD_SB_EXT_BF_POLLING after updating cmd_event.
+ */
+#define UBBD_SB_EXT_BF_CMD_EVENT		(1U << 1)
+
+/*
+ * cmd_op of IORING_OP_URING_CMD on /dev/ubbd_kringN, an alternative to
+ * read() and write() on it. Both complete with the current cmd_head once
+ * it differs from the cmd_tail in struct ubbd_uring_cmd, so the backend
+ * can go on scanning SEs in the mmapped cmd ring from its cmd_tail.
+ */
+#define UBBD_URING_CMD_FETCH			0x01	/* wait for new SEs */
+#define UBBD_URING_CMD_COMMIT_AND_FETCH		0x02	/* like write(), then FETCH */
+
+/* payload in the cmd area of the SQE */
+struct ubbd_uring_cmd {
+	__u32	cmd_tail;
+	__u32	pad;
+};
+
+/*
+ * ioctl on /dev/ubbd_kringN: reap the posted CEs like write() does, then
+ * wait until cmd_head differs from cmd_tail or timeout_ms expired, and
+ * return the current cmd_head. timeout_ms of 0 doesn't wait, (__u32)-1
+ * waits without timeout.
+ */
+struct ubbd_kring_reap_wait {
+	__u32	cmd_tail;	/* in */
+	__u32	timeout_ms;	/* in */
+	__u32	cmd_head;	/* out */
+	__u32	pad;
+};
+
+#define UBBD_KRING_IOC_MAGIC			'U'
+#define UBBD_KRING_IOC_REAP_AND_WAIT		_IOWR(UBBD_KRING_IOC_MAGIC, 0x01, struct ubbd_kring_reap_wait)
+
+/*
+ * ioctl on /dev/ubbd_kringN: replace the eventfds of the queue, -1 for
+ * none. cmd_fd is signalled whenever the kring would be notified of new
+ * SEs. The kernel watches compr_fd and reaps the posted CEs when it is
+ * written, as a write() on the kring would.
+ */
+struct ubbd_kring_eventfd {
+	__s32	cmd_fd;
+	__s32	compr_fd;
+};
+
+#define UBBD_KRING_IOC_SET_EVENTFD		_IOW(UBBD_KRING_IOC_MAGIC, 0x02, struct ubbd_kring_eventfd)
+
+/*
+ * /dev/ubbd_kring_mux aggregates the notifies of many krings. Each open
+ * of it is one notifier with a bitmap of UBBD_KRING_MUX_SLOTS bits, which
+ * the backend mmaps at offset 0. A kring attached to the notifier sets
+ * its slot bit whenever it would notify, and the notifier fd becomes
+ * readable, like a kring fd, when a bit went from 0 to 1. The backend
+ * consumes the bitmap by atomically exchanging its words with 0.
+ */
+#define UBBD_KRING_MUX_SLOTS			(4096 * 8)
+
+struct ubbd_kring_mux_attach {
+	__u32	kring_minor;	/* minor of /dev/ubbd_kringN */
+	__u32	slot;		/* < UBBD_KRING_MUX_SLOTS, ignored for DETACH */
+};
+
+#define UBBD_KRING_MUX_IOC_ATTACH		_IOW(UBBD_KRING_IOC_MAGIC, 0x10, struct ubbd_kring_mux_attach)
+#define UBBD_KRING_MUX_IOC_DETACH		_IOW(UBBD_KRING_IOC_MAGIC, 0x11, struct ubbd_kring_mux_attach)
+
+#endif /* UBBD_EXT_H */
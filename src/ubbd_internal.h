@@ -3,6 +3,9 @@
 
 #include <linux/bsearch.h>
 #include <linux/xarray.h>
+#include <linux/sbitmap.h>
+#include <linux/mempool.h>
+#include <linux/shrinker.h>
 
 #include <linux/kernel.h>
 #include <linux/device.h>
@@ -14,18 +17,27 @@
 #include <linux/idr.h>
 #include <linux/workqueue.h>
 #include <linux/delay.h>
+#include <linux/kthread.h>
+#include <linux/poll.h>
 #include <net/genetlink.h>
 
 #include <linux/types.h>
 
 #include "ubbd.h"
+#include "ubbd_ext.h"
 #include "compat.h"
 
+#ifdef HAVE_URING_CMD
+#include <linux/io_uring/cmd.h>
+#endif /* HAVE_URING_CMD */
+
 #define DEV_NAME_LEN 32
 #define UBBD_SINGLE_MAJOR_PART_SHIFT 4
 #define UBBD_DRV_NAME "ubbd"
 
 #define UBBD_KRING_DATA_PAGES	(256 * 1024)
+#define UBBD_QUEUE_DEPTH_DEFAULT	128
+/* data pages kept back from the shrinker, UBBD_ATTR_FLAGS_ADD_PREALLOC only */
 #define UBBD_KRING_DATA_RESERVE_PERCENT	75
 
 /* request stats */
@@ -45,6 +57,7 @@ extern struct workqueue_struct *ubbd_wq;
 #include <linux/device.h>
 #include <linux/fs.h>
 #include <linux/interrupt.h>
+#include <linux/srcu.h>
 
 struct module;
 struct ubbd_kring_map;
@@ -78,9 +91,12 @@ struct ubbd_kring_device {
 	atomic_t                event;
 	struct fasync_struct    *async_queue;
 	wait_queue_head_t       wait;
-	struct ubbd_kring_info         *info;
-	struct mutex		info_lock;
+	struct ubbd_kring_info __rcu	*info;	/* protected by srcu */
+	struct srcu_struct	srcu;
 	struct kobject          *map_dir;
+	struct ubbd_kring_mux __rcu	*mux;	/* see ubbd_kring_mux_notify() */
+	u32			mux_slot;
+	struct list_head	mux_node;
 };
 
 /**
@@ -95,6 +111,8 @@ struct ubbd_kring_device {
  * @open:		open operation for this ubbd_kring device
  * @release:		release operation for this ubbd_kring device
  * @irqcontrol:		disable/enable irqs when 0/1 is written to /dev/ubbd_kringX
+ * @ioctl:		ioctl on /dev/ubbd_kringX
+ * @uring_cmd:		IORING_OP_URING_CMD issued on /dev/ubbd_kringX
  */
 struct ubbd_kring_info {
 	struct ubbd_kring_device	*ubbd_kring_dev;
@@ -106,6 +124,11 @@ struct ubbd_kring_info {
 	int (*open)(struct ubbd_kring_info *info, struct inode *inode);
 	int (*release)(struct ubbd_kring_info *info, struct inode *inode);
 	int (*irqcontrol)(struct ubbd_kring_info *info, s32 irq_on);
+	long (*ioctl)(struct ubbd_kring_info *info, unsigned int cmd, unsigned long arg);
+#ifdef HAVE_URING_CMD
+	int (*uring_cmd)(struct ubbd_kring_info *info, struct io_uring_cmd *cmd,
+			 unsigned int issue_flags);
+#endif /* HAVE_URING_CMD */
 };
 
 extern int __must_check
@@ -146,37 +169,82 @@ extern int __must_check
 	__devm_ubbd_kring_register_device(THIS_MODULE, parent, info)
 
 struct ubbd_queue {
+	/* read-mostly, set up at creation */
 	struct ubbd_device	*ubbd_dev;
-
 	int			index;
-	struct list_head	inflight_reqs;
-	spinlock_t		inflight_reqs_lock;
-	u64			req_tid;
-
-	struct ubbd_kring_info		ubbd_kring_info;
-	struct xarray		data_pages_array;
-	unsigned long		*data_bitmap;
-	struct mutex		pages_mutex;
 
 	struct ubbd_sb		*sb_addr;
-
+	struct ubbd_sb_ext	*sb_ext;	/* in the info area of sb_addr */
+	/* ring indexes, in sb_addr or on their own lines with UBBD_SB_F_SPLIT_IDX */
+	u32			*sb_cmd_head;
+	u32			*sb_cmd_tail;
+	u32			*sb_compr_head;
+	u32			*sb_compr_tail;
+	void			*slots;		/* UBBD_SB_F_SLOT_RING */
+	u32			slot_size;
+	u32			nr_slots;
 	void			*cmdr;
 	void			*compr;
-	spinlock_t		cmdr_lock;
-	spinlock_t		compr_lock;
 	size_t			data_off;
 	u32			data_pages;
-	u32			data_pages_allocated;
 	u32			data_pages_reserved;
 	uint32_t		max_blocks;
 	size_t			mmap_pages;
-
-	struct mutex 		state_lock;
+	int			numa_node;	/* home node, see ubbd_dev_init_queue_nodes() */
+
+	/* submit side, written by ubbd_queue_rq() */
+	spinlock_t		cmdr_lock ____cacheline_aligned_in_smp;
+	u32			cmd_head;	/* published by ubbd_queue_commit() */
+	u32			req_gen;	/* protected by cmdr_lock */
+	u64			notify_delivered;	/* protected by cmdr_lock */
+	u64			notify_suppressed;	/* protected by cmdr_lock */
+	int			submit_cpu;
+	atomic_t		inflight;	/* requests owned by the backend */
+	struct sbitmap_queue	cmd_slots;	/* free SE slots */
+	atomic64_t		cmdr_full;	/* no room for an SE */
+	atomic64_t		data_full;	/* no free data area slots */
+	atomic64_t		res_stops;	/* hctx stopped for one of the above */
+	atomic_t		res_seq;	/* bumped whenever room is freed */
+
+	/* complete side, written when the backend posts CEs */
+	spinlock_t		compr_lock ____cacheline_aligned_in_smp;
+	u64			completed;	/* protected by compr_lock */
+	atomic64_t		complete_kicks;	/* write()s on the kring */
 	unsigned long		flags;
 	atomic_t		status;
+	struct work_struct	complete_work;
+	struct task_struct	*complete_thread;
+
+	/* data area */
+	struct sbitmap_queue	data_sbq ____cacheline_aligned_in_smp;	/* free slots in the data area */
+	atomic_t		data_pages_allocated;
+	struct xarray		data_pages_array;
+	struct mutex		pages_mutex;	/* page unmap vs. mmap fault */
+	mempool_t		*page_pool;	/* UBBD_ATTR_FLAGS_ADD_PREALLOC */
+	struct work_struct	pool_refill_work;
+	unsigned long		*data_ref;	/* slot used since the last shrink pass */
+	unsigned long		*data_reclaim;	/* slot claimed by the shrinker */
+	u32			shrink_hand;	/* protected by pages_mutex */
+	atomic64_t		data_pages_reclaimed;
+	atomic64_t		data_unmaps;	/* unmap_mapping_range() calls */
+	struct work_struct	prealloc_work;
+	int			prealloc_ret;
+	struct list_head	prealloc_pages;	/* not given to a slot yet */
+	spinlock_t		prealloc_lock;
+
+	/* control path */
+	struct ubbd_kring_info		ubbd_kring_info ____cacheline_aligned_in_smp;
+	wait_queue_head_t	cmd_wait;	/* UBBD_KRING_IOC_REAP_AND_WAIT */
+	struct eventfd_ctx __rcu	*cmd_efd;	/* protected by state_lock */
+	struct eventfd_ctx	*compr_efd;	/* protected by state_lock */
+	wait_queue_entry_t	compr_efd_wait;
+	poll_table		compr_efd_pt;
+	spinlock_t		fetch_lock;
+	struct list_head	fetch_cmds;	/* parked UBBD_URING_CMD_FETCH */
+
+	struct mutex 		state_lock;
 
 	struct inode		*inode;
-	struct work_struct	complete_work;
 	cpumask_t		cpumask;
 	pid_t			backend_pid;
 	struct blk_mq_hw_ctx	*mq_hctx;
@@ -197,6 +265,8 @@ struct ubbd_queue {
 };
 
 #define UBBD_QUEUE_FLAGS_HAS_BACKEND	1
+#define UBBD_QUEUE_FLAGS_COMPLETE_PENDING	2	/* kick for complete_thread */
+#define UBBD_QUEUE_FLAGS_WAIT_RES	3	/* hctx stopped until room is freed */
 
 struct ubbd_device {
 	int			dev_id;		/* blkdev unique id */
@@ -221,18 +291,71 @@ struct ubbd_device {
 	unsigned long		open_count;	/* protected by lock */
 
 	uint32_t		num_queues;
+	uint32_t		num_poll_queues;	/* the last ones in queues[] */
 	struct ubbd_queue	*queues;
 	struct workqueue_struct	*task_wq;  /* workqueue for request work */
 
 	u64			dev_size;
 	u64			dev_features;
 	u32			io_timeout;
+	u32			complete_ctx;	/* enum ubbd_complete_ctx */
+	u32			complete_poll_us;
+	u32			inline_data_max;
+	u32			cmdr_size;
+	u32			compr_size;
+	u32			queue_depth;
+
+	struct shrinker		*shrinker;	/* idle cached data pages */
+#ifndef HAVE_SHRINKER_ALLOC
+	struct shrinker		data_shrinker;
+#endif /* HAVE_SHRINKER_ALLOC */
 
 	u8			status;
 	u32			status_flags;
 	struct kref		kref;
 };
 
+static inline bool ubbd_dev_zerocopy(struct ubbd_device *ubbd_dev)
+{
+	return (ubbd_dev->dev_features & UBBD_ATTR_FLAGS_ADD_ZEROCOPY);
+}
+
+static inline bool ubbd_dev_slot_ring(struct ubbd_device *ubbd_dev)
+{
+	return (ubbd_dev->dev_features & UBBD_ATTR_FLAGS_ADD_SLOT_RING);
+}
+
+static inline bool ubbd_dev_split_idx(struct ubbd_device *ubbd_dev)
+{
+	return (ubbd_dev->dev_features & UBBD_ATTR_FLAGS_ADD_SPLIT_IDX);
+}
+
+static inline struct ubbd_device *ubbd_shrinker_to_dev(struct shrinker *shrinker)
+{
+#ifdef HAVE_SHRINKER_ALLOC
+	return shrinker->private_data;
+#else
+	return container_of(shrinker, struct ubbd_device, data_shrinker);
+#endif /* HAVE_SHRINKER_ALLOC */
+}
+
+static inline bool ubbd_dev_prealloc(struct ubbd_device *ubbd_dev)
+{
+	return (ubbd_dev->dev_features & UBBD_ATTR_FLAGS_ADD_PREALLOC);
+}
+
+static inline bool ubbd_dev_compact_se(struct ubbd_device *ubbd_dev)
+{
+	return (ubbd_dev->dev_features & UBBD_ATTR_FLAGS_ADD_COMPACT_SE);
+}
+
+static inline bool ubbd_queue_is_poll(struct ubbd_queue *ubbd_q)
+{
+	struct ubbd_device *ubbd_dev = ubbd_q->ubbd_dev;
+
+	return (ubbd_q->index >= ubbd_dev->num_queues - ubbd_dev->num_poll_queues);
+}
+
 #define UBBD_DEV_STATUS_FLAG_INTRANS	1 << 0	/* bit in status_flags for is in state transition */
 
 static inline bool ubbd_dev_status_flags_test(struct ubbd_device *ubbd_dev, u32 bit)
@@ -255,7 +378,14 @@ struct ubbd_dev_add_opts {
 	u64	device_size;
 	u64	dev_features;
 	u32	num_queues;
+	u32	poll_queues;
 	u32	io_timeout;
+	u32	complete_ctx;
+	u32	complete_poll_us;
+	u32	inline_data_max;
+	u32	cmdr_size;
+	u32	compr_size;
+	u32	queue_depth;
 };
 
 struct ubbd_dev_config_opts {
@@ -332,14 +462,19 @@ struct ubbd_request {
 	struct ubbd_se		*se;
 	struct ubbd_ce		*ce;
 	struct request		*req;
+	u32			slot;		/* UBBD_SB_F_SLOT_RING */
 
 	enum ubbd_op		op;
-	u64			req_tid;
-	struct list_head	inflight_reqs_node;
+	unsigned long		flags;
+	atomic64_t		req_tid;	/* 0 when not inflight */
+	int			result;
+	struct list_head	complete_node;	/* on the completion sweep list */
 	uint32_t		pi_cnt;
+	uint32_t		iov_cnt;	/* se->iov_cnt, extents with UBBD_SB_F_COMPACT_SE */
 	uint32_t		inline_pi[UBBD_REQ_INLINE_PI_MAX];
 	uint32_t		*pi;
 	struct work_struct	work;
+	int			res_seq;	/* ubbd_q->res_seq at submit */
 
 #ifdef	UBBD_REQUEST_STATS
 	ktime_t			start_kt;
@@ -352,6 +487,38 @@ struct ubbd_request {
 #endif
 };
 
+#define UBBD_REQ_FLAGS_ZEROCOPY	0	/* bio pages are mapped into the data area */
+#define UBBD_REQ_FLAGS_DATA_SLOTS	1	/* request holds data area slots */
+#define UBBD_REQ_FLAGS_INLINE_DATA	2	/* data is carried in the SE, see UBBD_SE_HDR_INLINE_DATA */
+
+/*
+ * req_tid handed to the backend in se->priv_data:
+ *
+ * | generation (32 bits) | hctx index (16 bits) | blk-mq tag (16 bits) |
+ *
+ * hctx index and tag find the request in O(1), the generation makes a
+ * stale or duplicated completion miss a request that reuses the tag.
+ */
+#define UBBD_REQ_TID(gen, hctx_idx, tag)	\
+	(((u64)(gen) << 32) | ((u64)(hctx_idx) << 16) | (u64)(tag))
+#define UBBD_REQ_TID_HCTX(tid)		(((tid) >> 16) & 0xffff)
+#define UBBD_REQ_TID_TAG(tid)		((tid) & 0xffff)
+
+/*
+ * iovs in one SE slot. max_hw_sectors is 128 and every bvec holds at least
+ * one sector, so a request never has more.
+ */
+#define UBBD_SLOT_IOV_MAX	128
+
+/* size of one entry in se->iov[] */
+static inline size_t ubbd_queue_iov_size(struct ubbd_queue *ubbd_q)
+{
+	if (ubbd_dev_compact_se(ubbd_q->ubbd_dev))
+		return sizeof(struct ubbd_se_extent);
+
+	return sizeof(struct iovec);
+}
+
 #define UPDATE_CMDR_HEAD(head, used, size) smp_store_release(&head, ((head % size) + used) % size)
 #define UPDATE_CMDR_TAIL(tail, used, size) smp_store_release(&tail, ((tail % size) + used) % size)
 
@@ -370,10 +537,37 @@ static inline void ubbd_flush_dcache_range(void *vaddr, size_t size)
                 size -= PAGE_SIZE;
         }
 }
+
+static inline void ubbd_queue_flush_sb(struct ubbd_queue *ubbd_q)
+{
+	ubbd_flush_dcache_range(ubbd_q->sb_addr, sizeof(*ubbd_q->sb_addr));
+	if (ubbd_dev_split_idx(ubbd_q->ubbd_dev))
+		ubbd_flush_dcache_range((void *)ubbd_q->sb_addr + ubbd_q->sb_ext->idx_off,
+				UBBD_SB_IDX_NR * UBBD_SB_IDX_STRIDE);
+}
 extern struct genl_family ubbd_genl_family;
 void complete_work_fn(struct work_struct *work);
 blk_status_t ubbd_queue_rq(struct blk_mq_hw_ctx *hctx,
 		const struct blk_mq_queue_data *bd);
+#ifdef HAVE_COMMIT_RQS
+void ubbd_commit_rqs(struct blk_mq_hw_ctx *hctx);
+#endif /* HAVE_COMMIT_RQS */
+#ifdef HAVE_QUEUE_RQS
+#ifdef HAVE_RQ_LIST
+void ubbd_queue_rqs(struct rq_list *rqlist);
+#else
+void ubbd_queue_rqs(struct request **rqlist);
+#endif /* HAVE_RQ_LIST */
+#endif /* HAVE_QUEUE_RQS */
+void ubbd_queue_commit(struct ubbd_queue *ubbd_q);
+#ifdef HAVE_IO_COMP_BATCH
+int ubbd_poll(struct blk_mq_hw_ctx *hctx, struct io_comp_batch *iob);
+#ifdef HAVE_MAP_QUEUES_VOID
+void ubbd_map_queues(struct blk_mq_tag_set *set);
+#else
+int ubbd_map_queues(struct blk_mq_tag_set *set);
+#endif /* HAVE_MAP_QUEUES_VOID */
+#endif /* HAVE_IO_COMP_BATCH */
 void ubbd_end_inflight_reqs(struct ubbd_device *ubbd_dev, int ret);
 void ubbd_queue_end_inflight_reqs(struct ubbd_queue *ubbd_q, int ret);
 
@@ -383,6 +577,9 @@ enum blk_eh_timer_return ubbd_timeout(struct request *req, bool reserved);
 enum blk_eh_timer_return ubbd_timeout(struct request *req);
 #endif /* HAVE_TIMEOUT_RESERVED */
 struct ubbd_device *ubbd_dev_add_dev(struct ubbd_dev_add_opts *);
+u32 ubbd_cmdr_se_capacity(u32 cmdr_size, u64 dev_features, u32 inline_data_max);
+int ubbd_dev_shrinker_init(struct ubbd_device *ubbd_dev);
+void ubbd_dev_shrinker_exit(struct ubbd_device *ubbd_dev);
 int ubbd_dev_remove_dev(struct ubbd_device *ubbd_dev);
 int ubbd_dev_config(struct ubbd_device *ubbd_dev, struct ubbd_dev_config_opts *opts);
 void ubbd_dev_remove_disk(struct ubbd_device *ubbd_dev, bool force);
@@ -390,11 +587,18 @@ int ubbd_dev_stop_queue(struct ubbd_device *ubbd_dev, int queue_id);
 int ubbd_dev_start_queue(struct ubbd_device *ubbd_dev, int queue_id);
 int ubbd_dev_add_disk(struct ubbd_device *ubbd_dev);
 int ubbd_queue_kring_init(struct ubbd_queue *ubbd_q);
+void ubbd_queue_kring_stop(struct ubbd_queue *ubbd_q);
 void ubbd_queue_kring_destroy(struct ubbd_queue *ubbd_q);
 void ubbd_kring_unmap_range(struct ubbd_queue *ubbd_q,
 		loff_t const holebegin, loff_t const holelen, int even_cows);
-
-void ubbd_queue_complete(struct ubbd_queue *ubbd_q);
+void ubbd_queue_notify(struct ubbd_queue *ubbd_q);
+#ifdef HAVE_URING_CMD
+void ubbd_queue_complete_fetch(struct ubbd_queue *ubbd_q, int res);
+#endif /* HAVE_URING_CMD */
+
+int ubbd_queue_complete(struct ubbd_queue *ubbd_q);
+void ubbd_queue_kick_complete(struct ubbd_queue *ubbd_q);
+int ubbd_complete_thread_fn(void *data);
 
 /* debugfs */
 void ubbd_debugfs_add_dev(struct ubbd_device *ubbd_dev);
@@ -15,6 +15,10 @@
 #include <linux/string.h>
 #include <linux/kobject.h>
 #include <linux/cdev.h>
+#include <linux/file.h>
+#include <linux/eventfd.h>
+#include <linux/miscdevice.h>
+#include <linux/srcu.h>
 #include "ubbd_internal.h"
 
 #define KRING_MAX_DEVICES		(1U << MINORBITS)
@@ -27,6 +31,14 @@ static const struct file_operations ubbd_kring_fops;
 /* Protect idr accesses */
 static DEFINE_MUTEX(minor_lock);
 
+/*
+ * idev->info is published and retired through idev->srcu, so the kring
+ * file operations need no lock to find it. ubbd_kring_unregister_device()
+ * waits for a grace period before the owner may free the info. Each
+ * kring has its own srcu_struct: readers sleep in REAP_AND_WAIT, and
+ * removing one kring must not wait for the backends of the others.
+ */
+
 /*
  * attributes
  */
@@ -34,19 +46,21 @@ static ssize_t name_show(struct device *dev,
 			 struct device_attribute *attr, char *buf)
 {
 	struct ubbd_kring_device *idev = dev_get_drvdata(dev);
-	int ret;
+	struct ubbd_kring_info *info;
+	int ret, idx;
 
-	mutex_lock(&idev->info_lock);
-	if (!idev->info) {
+	idx = srcu_read_lock(&idev->srcu);
+	info = srcu_dereference(idev->info, &idev->srcu);
+	if (!info) {
 		ret = -EINVAL;
 		dev_err(dev, "the device has been unregistered\n");
 		goto out;
 	}
 
-	ret = sprintf(buf, "%s\n", idev->info->name);
+	ret = sprintf(buf, "%s\n", info->name);
 
 out:
-	mutex_unlock(&idev->info_lock);
+	srcu_read_unlock(&idev->srcu, idx);
 	return ret;
 }
 static DEVICE_ATTR_RO(name);
@@ -55,19 +69,21 @@ static ssize_t version_show(struct device *dev,
 			    struct device_attribute *attr, char *buf)
 {
 	struct ubbd_kring_device *idev = dev_get_drvdata(dev);
-	int ret;
+	struct ubbd_kring_info *info;
+	int ret, idx;
 
-	mutex_lock(&idev->info_lock);
-	if (!idev->info) {
+	idx = srcu_read_lock(&idev->srcu);
+	info = srcu_dereference(idev->info, &idev->srcu);
+	if (!info) {
 		ret = -EINVAL;
 		dev_err(dev, "the device has been unregistered\n");
 		goto out;
 	}
 
-	ret = sprintf(buf, "%s\n", idev->info->version);
+	ret = sprintf(buf, "%s\n", info->version);
 
 out:
-	mutex_unlock(&idev->info_lock);
+	srcu_read_unlock(&idev->srcu, idx);
 	return ret;
 }
 static DEVICE_ATTR_RO(version);
@@ -123,6 +139,31 @@ static void ubbd_kring_free_minor(unsigned long minor)
 	mutex_unlock(&minor_lock);
 }
 
+/*
+ * One open of /dev/ubbd_kring_mux, with the krings attached to it. The
+ * attach state of all krings is protected by mux_lock, the notify path
+ * reads idev->mux under RCU.
+ */
+struct ubbd_kring_mux {
+	unsigned long		*bitmap;	/* UBBD_KRING_MUX_SLOTS bits, mmapped */
+	atomic_t		event;
+	s32			event_count;
+	wait_queue_head_t	wait;
+	struct list_head	devs;
+};
+
+static DEFINE_MUTEX(mux_lock);
+
+static void ubbd_kring_mux_notify(struct ubbd_kring_mux *mux, u32 slot)
+{
+	/* the backend didn't consume the bit yet, it will see this kring */
+	if (test_and_set_bit(slot, mux->bitmap))
+		return;
+
+	atomic_inc(&mux->event);
+	wake_up_interruptible(&mux->wait);
+}
+
 /**
  * ubbd_kring_event_notify - trigger an interrupt event
  * @info: KRING device capabilities
@@ -130,12 +171,238 @@ static void ubbd_kring_free_minor(unsigned long minor)
 void ubbd_kring_event_notify(struct ubbd_kring_info *info)
 {
 	struct ubbd_kring_device *idev = info->ubbd_kring_dev;
+	struct ubbd_kring_mux *mux;
 
 	atomic_inc(&idev->event);
 	wake_up_interruptible(&idev->wait);
+
+	rcu_read_lock();
+	mux = rcu_dereference(idev->mux);
+	if (mux)
+		ubbd_kring_mux_notify(mux, idev->mux_slot);
+	rcu_read_unlock();
 }
 EXPORT_SYMBOL_GPL(ubbd_kring_event_notify);
 
+/* called with mux_lock held */
+static void ubbd_kring_mux_detach(struct ubbd_kring_device *idev)
+{
+	if (!rcu_access_pointer(idev->mux))
+		return;
+
+	list_del_init(&idev->mux_node);
+	RCU_INIT_POINTER(idev->mux, NULL);
+	synchronize_rcu();
+	put_device(&idev->dev);
+}
+
+/* called with mux_lock held */
+static bool ubbd_kring_mux_slot_busy(struct ubbd_kring_mux *mux, u32 slot)
+{
+	struct ubbd_kring_device *idev;
+
+	list_for_each_entry(idev, &mux->devs, mux_node) {
+		if (idev->mux_slot == slot)
+			return true;
+	}
+
+	return false;
+}
+
+static int ubbd_kring_mux_attach(struct ubbd_kring_mux *mux,
+		struct ubbd_kring_mux_attach *attach)
+{
+	struct ubbd_kring_device *idev;
+	int ret = 0;
+
+	if (attach->slot >= UBBD_KRING_MUX_SLOTS)
+		return -EINVAL;
+
+	mutex_lock(&minor_lock);
+	idev = idr_find(&ubbd_kring_idr, attach->kring_minor);
+	if (idev)
+		get_device(&idev->dev);
+	mutex_unlock(&minor_lock);
+	if (!idev)
+		return -ENODEV;
+
+	mutex_lock(&mux_lock);
+	if (rcu_access_pointer(idev->mux) ||
+			ubbd_kring_mux_slot_busy(mux, attach->slot)) {
+		ret = -EBUSY;
+		goto err_put;
+	}
+
+	idev->mux_slot = attach->slot;
+	list_add_tail(&idev->mux_node, &mux->devs);
+	rcu_assign_pointer(idev->mux, mux);
+	mutex_unlock(&mux_lock);
+
+	/* SEs may be pending already */
+	ubbd_kring_mux_notify(mux, attach->slot);
+
+	return 0;
+
+err_put:
+	mutex_unlock(&mux_lock);
+	put_device(&idev->dev);
+	return ret;
+}
+
+static int ubbd_kring_mux_detach_minor(struct ubbd_kring_mux *mux, u32 minor)
+{
+	struct ubbd_kring_device *idev;
+	int ret = -ENODEV;
+
+	mutex_lock(&mux_lock);
+	list_for_each_entry(idev, &mux->devs, mux_node) {
+		if (idev->minor == minor) {
+			ubbd_kring_mux_detach(idev);
+			ret = 0;
+			break;
+		}
+	}
+	mutex_unlock(&mux_lock);
+
+	return ret;
+}
+
+static int ubbd_kring_mux_open(struct inode *inode, struct file *filep)
+{
+	struct ubbd_kring_mux *mux;
+
+	BUILD_BUG_ON(UBBD_KRING_MUX_SLOTS / BITS_PER_BYTE > PAGE_SIZE);
+
+	mux = kzalloc(sizeof(*mux), GFP_KERNEL);
+	if (!mux)
+		return -ENOMEM;
+
+	mux->bitmap = (unsigned long *)get_zeroed_page(GFP_KERNEL);
+	if (!mux->bitmap) {
+		kfree(mux);
+		return -ENOMEM;
+	}
+
+	atomic_set(&mux->event, 0);
+	init_waitqueue_head(&mux->wait);
+	INIT_LIST_HEAD(&mux->devs);
+	filep->private_data = mux;
+
+	return 0;
+}
+
+static int ubbd_kring_mux_release(struct inode *inode, struct file *filep)
+{
+	struct ubbd_kring_mux *mux = filep->private_data;
+	struct ubbd_kring_device *idev, *next;
+
+	/* a single grace period for all of them, there may be hundreds */
+	mutex_lock(&mux_lock);
+	list_for_each_entry(idev, &mux->devs, mux_node)
+		RCU_INIT_POINTER(idev->mux, NULL);
+	synchronize_rcu();
+
+	list_for_each_entry_safe(idev, next, &mux->devs, mux_node) {
+		list_del_init(&idev->mux_node);
+		put_device(&idev->dev);
+	}
+	mutex_unlock(&mux_lock);
+
+	free_page((unsigned long)mux->bitmap);
+	kfree(mux);
+
+	return 0;
+}
+
+static __poll_t ubbd_kring_mux_poll(struct file *filep, poll_table *wait)
+{
+	struct ubbd_kring_mux *mux = filep->private_data;
+
+	poll_wait(filep, &mux->wait, wait);
+	if (mux->event_count != atomic_read(&mux->event)) {
+		mux->event_count = atomic_read(&mux->event);
+		return EPOLLIN | EPOLLRDNORM;
+	}
+	return 0;
+}
+
+static ssize_t ubbd_kring_mux_read(struct file *filep, char __user *buf,
+			size_t count, loff_t *ppos)
+{
+	struct ubbd_kring_mux *mux = filep->private_data;
+	s32 event_count;
+	int ret;
+
+	if (count != sizeof(s32))
+		return -EINVAL;
+
+	if (filep->f_flags & O_NONBLOCK) {
+		if (mux->event_count == atomic_read(&mux->event))
+			return -EAGAIN;
+	} else {
+		ret = wait_event_interruptible(mux->wait,
+				mux->event_count != atomic_read(&mux->event));
+		if (ret)
+			return ret;
+	}
+
+	event_count = atomic_read(&mux->event);
+	if (copy_to_user(buf, &event_count, count))
+		return -EFAULT;
+	mux->event_count = event_count;
+
+	return count;
+}
+
+static int ubbd_kring_mux_mmap(struct file *filep, struct vm_area_struct *vma)
+{
+	struct ubbd_kring_mux *mux = filep->private_data;
+
+	if (vma->vm_pgoff || vma_pages(vma) != 1)
+		return -EINVAL;
+
+	return vm_insert_page(vma, vma->vm_start, virt_to_page(mux->bitmap));
+}
+
+static long ubbd_kring_mux_ioctl(struct file *filep, unsigned int cmd, unsigned long arg)
+{
+	struct ubbd_kring_mux *mux = filep->private_data;
+	struct ubbd_kring_mux_attach attach;
+
+	switch (cmd) {
+	case UBBD_KRING_MUX_IOC_ATTACH:
+	case UBBD_KRING_MUX_IOC_DETACH:
+		break;
+	default:
+		return -ENOTTY;
+	}
+
+	if (copy_from_user(&attach, (void __user *)arg, sizeof(attach)))
+		return -EFAULT;
+
+	if (cmd == UBBD_KRING_MUX_IOC_ATTACH)
+		return ubbd_kring_mux_attach(mux, &attach);
+
+	return ubbd_kring_mux_detach_minor(mux, attach.kring_minor);
+}
+
+static const struct file_operations ubbd_kring_mux_fops = {
+	.owner		= THIS_MODULE,
+	.open		= ubbd_kring_mux_open,
+	.release	= ubbd_kring_mux_release,
+	.read		= ubbd_kring_mux_read,
+	.poll		= ubbd_kring_mux_poll,
+	.mmap		= ubbd_kring_mux_mmap,
+	.unlocked_ioctl	= ubbd_kring_mux_ioctl,
+	.llseek		= noop_llseek,
+};
+
+static struct miscdevice ubbd_kring_mux_misc = {
+	.minor		= MISC_DYNAMIC_MINOR,
+	.name		= "ubbd_kring_mux",
+	.fops		= &ubbd_kring_mux_fops,
+};
+
 struct ubbd_kring_listener {
 	struct ubbd_kring_device *dev;
 	s32 event_count;
@@ -145,7 +412,8 @@ static int ubbd_kring_open(struct inode *inode, struct file *filep)
 {
 	struct ubbd_kring_device *idev;
 	struct ubbd_kring_listener *listener;
-	int ret = 0;
+	struct ubbd_kring_info *info;
+	int ret = 0, idx;
 
 	mutex_lock(&minor_lock);
 	idev = idr_find(&ubbd_kring_idr, iminor(inode));
@@ -172,16 +440,17 @@ static int ubbd_kring_open(struct inode *inode, struct file *filep)
 	listener->event_count = atomic_read(&idev->event);
 	filep->private_data = listener;
 
-	mutex_lock(&idev->info_lock);
-	if (!idev->info) {
-		mutex_unlock(&idev->info_lock);
+	idx = srcu_read_lock(&idev->srcu);
+	info = srcu_dereference(idev->info, &idev->srcu);
+	if (!info) {
+		srcu_read_unlock(&idev->srcu, idx);
 		ret = -EINVAL;
 		goto err_infoopen;
 	}
 
-	if (idev->info->open)
-		ret = idev->info->open(idev->info, inode);
-	mutex_unlock(&idev->info_lock);
+	if (info->open)
+		ret = info->open(info, inode);
+	srcu_read_unlock(&idev->srcu, idx);
 	if (ret)
 		goto err_infoopen;
 
@@ -210,14 +479,16 @@ static int ubbd_kring_fasync(int fd, struct file *filep, int on)
 
 static int ubbd_kring_release(struct inode *inode, struct file *filep)
 {
-	int ret = 0;
+	int ret = 0, idx;
 	struct ubbd_kring_listener *listener = filep->private_data;
 	struct ubbd_kring_device *idev = listener->dev;
+	struct ubbd_kring_info *info;
 
-	mutex_lock(&idev->info_lock);
-	if (idev->info && idev->info->release)
-		ret = idev->info->release(idev->info, inode);
-	mutex_unlock(&idev->info_lock);
+	idx = srcu_read_lock(&idev->srcu);
+	info = srcu_dereference(idev->info, &idev->srcu);
+	if (info && info->release)
+		ret = info->release(info, inode);
+	srcu_read_unlock(&idev->srcu, idx);
 
 	module_put(idev->owner);
 	kfree(listener);
@@ -253,13 +524,11 @@ static ssize_t ubbd_kring_read(struct file *filep, char __user *buf,
 	add_wait_queue(&idev->wait, &wait);
 
 	do {
-		mutex_lock(&idev->info_lock);
-		if (!idev->info) {
+		/* only checked, never dereferenced here */
+		if (!rcu_access_pointer(idev->info)) {
 			retval = -EIO;
-			mutex_unlock(&idev->info_lock);
 			break;
 		}
-		mutex_unlock(&idev->info_lock);
 
 		set_current_state(TASK_INTERRUPTIBLE);
 
@@ -298,9 +567,17 @@ static ssize_t ubbd_kring_write(struct file *filep, const char __user *buf,
 {
 	struct ubbd_kring_listener *listener = filep->private_data;
 	struct ubbd_kring_device *idev = listener->dev;
+	struct ubbd_kring_info *info;
 	ssize_t retval;
+	int idx;
 
-	retval = idev->info->irqcontrol(idev->info, 0);
+	idx = srcu_read_lock(&idev->srcu);
+	info = srcu_dereference(idev->info, &idev->srcu);
+	if (info)
+		retval = info->irqcontrol(info, 0);
+	else
+		retval = -EIO;
+	srcu_read_unlock(&idev->srcu, idx);
 
 	return retval ? retval : sizeof(s32);
 }
@@ -310,39 +587,107 @@ static int ubbd_kring_mmap(struct file *filep, struct vm_area_struct *vma)
 	struct ubbd_kring_listener *listener = filep->private_data;
 	struct ubbd_kring_device *idev = listener->dev;
 	unsigned long requested_pages, actual_pages;
-	int ret = 0;
+	struct ubbd_kring_info *info;
+	int ret = 0, idx;
 
 	if (vma->vm_end < vma->vm_start)
 		return -EINVAL;
 
 	vma->vm_private_data = idev;
 
-	mutex_lock(&idev->info_lock);
-	if (!idev->info) {
+	idx = srcu_read_lock(&idev->srcu);
+	info = srcu_dereference(idev->info, &idev->srcu);
+	if (!info) {
 		ret = -EINVAL;
 		goto out;
 	}
 
 	requested_pages = vma_pages(vma);
-	actual_pages = ((idev->info->mem[0].addr & ~PAGE_MASK)
-			+ idev->info->mem[0].size + PAGE_SIZE -1) >> PAGE_SHIFT;
+	actual_pages = ((info->mem[0].addr & ~PAGE_MASK)
+			+ info->mem[0].size + PAGE_SIZE -1) >> PAGE_SHIFT;
 	if (requested_pages > actual_pages) {
 		ret = -EINVAL;
 		goto out;
 	}
 
-	if (idev->info->mmap) {
-		ret = idev->info->mmap(idev->info, vma);
+	if (info->mmap) {
+		ret = info->mmap(info, vma);
 		goto out;
 	}
 
 	ret = -EINVAL;
 
  out:
-	mutex_unlock(&idev->info_lock);
+	srcu_read_unlock(&idev->srcu, idx);
 	return ret;
 }
 
+static long ubbd_kring_ioctl(struct file *filep, unsigned int cmd, unsigned long arg)
+{
+	struct ubbd_kring_listener *listener = filep->private_data;
+	struct ubbd_kring_device *idev = listener->dev;
+	struct ubbd_kring_info *info;
+	long ret;
+	int idx;
+
+	idx = srcu_read_lock(&idev->srcu);
+	info = srcu_dereference(idev->info, &idev->srcu);
+	if (!info)
+		ret = -EIO;
+	else if (!info->ioctl)
+		ret = -ENOTTY;
+	else
+		ret = info->ioctl(info, cmd, arg);
+	srcu_read_unlock(&idev->srcu, idx);
+
+	return ret;
+}
+
+#ifdef HAVE_URING_CMD
+/* lives in io_uring_cmd->pdu while the cmd is parked in fetch_cmds */
+struct ubbd_fetch_pdu {
+	struct list_head	node;
+	struct io_uring_cmd	*cmd;
+	int			res;
+	bool			completing;	/* CQE posted from task work */
+};
+
+static struct ubbd_fetch_pdu *ubbd_fetch_pdu(struct io_uring_cmd *cmd)
+{
+	BUILD_BUG_ON(sizeof(struct ubbd_fetch_pdu) > sizeof(cmd->pdu));
+
+	return (struct ubbd_fetch_pdu *)cmd->pdu;
+}
+
+static int ubbd_kring_uring_cmd(struct io_uring_cmd *cmd, unsigned int issue_flags)
+{
+	struct ubbd_kring_listener *listener = cmd->file->private_data;
+	struct ubbd_kring_device *idev = listener->dev;
+	struct ubbd_kring_info *info;
+	int ret, idx;
+
+	idx = srcu_read_lock(&idev->srcu);
+	info = srcu_dereference(idev->info, &idev->srcu);
+	if (!info) {
+		/*
+		 * Unregistered, the queue completed all parked cmds on its
+		 * way out. A cancel must still end every cmd that isn't
+		 * about to complete, or the io_uring can't exit.
+		 */
+		if ((issue_flags & IO_URING_F_CANCEL) &&
+				!READ_ONCE(ubbd_fetch_pdu(cmd)->completing))
+			io_uring_cmd_done(cmd, -ECANCELED, 0, issue_flags);
+		ret = -EIO;
+	} else if (!info->uring_cmd)
+		ret = -EOPNOTSUPP;
+	else
+		ret = info->uring_cmd(info, cmd, issue_flags);
+	srcu_read_unlock(&idev->srcu, idx);
+
+	return ret;
+}
+#endif /* HAVE_URING_CMD */
+
 static const struct file_operations ubbd_kring_fops = {
 	.owner		= THIS_MODULE,
 	.open		= ubbd_kring_open,
@@ -353,6 +698,10 @@ static const struct file_operations ubbd_kring_fops = {
 	.poll		= ubbd_kring_poll,
 	.fasync		= ubbd_kring_fasync,
 	.llseek		= noop_llseek,
+	.unlocked_ioctl	= ubbd_kring_ioctl,
+#ifdef HAVE_URING_CMD
+	.uring_cmd	= ubbd_kring_uring_cmd,
+#endif /* HAVE_URING_CMD */
 };
 
 static int ubbd_kring_major_init(void)
@@ -432,6 +781,7 @@ static void ubbd_kring_device_release(struct device *dev)
 {
 	struct ubbd_kring_device *idev = dev_get_drvdata(dev);
 
+	cleanup_srcu_struct(&idev->srcu);
 	kfree(idev);
 }
 
@@ -463,14 +813,21 @@ int __ubbd_kring_register_device(struct module *owner,
 		return -ENOMEM;
 	}
 
+	ret = init_srcu_struct(&idev->srcu);
+	if (ret) {
+		kfree(idev);
+		return ret;
+	}
+
 	idev->owner = owner;
-	idev->info = info;
-	mutex_init(&idev->info_lock);
+	RCU_INIT_POINTER(idev->info, info);
+	INIT_LIST_HEAD(&idev->mux_node);
 	init_waitqueue_head(&idev->wait);
 	atomic_set(&idev->event, 0);
 
 	ret = ubbd_kring_get_minor(idev);
 	if (ret) {
+		cleanup_srcu_struct(&idev->srcu);
 		kfree(idev);
 		return ret;
 	}
@@ -554,10 +911,13 @@ void ubbd_kring_unregister_device(struct ubbd_kring_info *info)
 	idev = info->ubbd_kring_dev;
 	minor = idev->minor;
 
-	mutex_lock(&idev->info_lock);
+	/* file operations that found the info are done with it after this */
+	rcu_assign_pointer(idev->info, NULL);
+	synchronize_srcu(&idev->srcu);
 
-	idev->info = NULL;
-	mutex_unlock(&idev->info_lock);
+	mutex_lock(&mux_lock);
+	ubbd_kring_mux_detach(idev);
+	mutex_unlock(&mux_lock);
 
 	wake_up_interruptible(&idev->wait);
 	kill_fasync(&idev->async_queue, SIGIO, POLL_HUP);
@@ -572,11 +932,24 @@ EXPORT_SYMBOL_GPL(ubbd_kring_unregister_device);
 
 int ubbd_kring_init(void)
 {
-	return init_ubbd_kring_class();
+	int ret;
+
+	ret = init_ubbd_kring_class();
+	if (ret)
+		return ret;
+
+	ret = misc_register(&ubbd_kring_mux_misc);
+	if (ret) {
+		printk(KERN_ERR "misc_register failed for ubbd_kring_mux\n");
+		release_ubbd_kring_class();
+	}
+
+	return ret;
 }
 
 void ubbd_kring_exit(void)
 {
+	misc_deregister(&ubbd_kring_mux_misc);
 	release_ubbd_kring_class();
 	idr_destroy(&ubbd_kring_idr);
 }
@@ -591,11 +964,333 @@ static int ubbd_irqcontrol(struct ubbd_kring_info *info, s32 irq_on)
 		return 0;
 	}
 
-	ubbd_queue_complete(ubbd_q);
+	atomic64_inc(&ubbd_q->complete_kicks);
+	ubbd_queue_kick_complete(ubbd_q);
+
+	return 0;
+}
+
+static bool ubbd_queue_cmd_ready(struct ubbd_queue *ubbd_q, u32 cmd_tail)
+{
+	return (smp_load_acquire(ubbd_q->sb_cmd_head) != cmd_tail ||
+		atomic_read(&ubbd_q->status) == UBBD_QUEUE_KSTATUS_REMOVING);
+}
+
+static long ubbd_queue_reap_and_wait(struct ubbd_queue *ubbd_q,
+		struct ubbd_kring_reap_wait __user *uarg)
+{
+	struct ubbd_kring_reap_wait rw;
+	long timeout, ret;
+
+	if (copy_from_user(&rw, uarg, sizeof(rw)))
+		return -EFAULT;
+
+	ubbd_irqcontrol(&ubbd_q->ubbd_kring_info, 0);
+
+	if (rw.timeout_ms == U32_MAX)
+		timeout = MAX_SCHEDULE_TIMEOUT;
+	else
+		timeout = msecs_to_jiffies(rw.timeout_ms);
+
+	if (timeout) {
+		/* woken by ubbd_queue_commit() even if bflags suppress the notify */
+		ret = wait_event_interruptible_timeout(ubbd_q->cmd_wait,
+				ubbd_queue_cmd_ready(ubbd_q, rw.cmd_tail), timeout);
+		if (ret < 0)
+			return ret;
+	}
+
+	if (atomic_read(&ubbd_q->status) == UBBD_QUEUE_KSTATUS_REMOVING)
+		return -ENODEV;
+
+	rw.cmd_head = smp_load_acquire(ubbd_q->sb_cmd_head);
+	if (put_user(rw.cmd_head, &uarg->cmd_head))
+		return -EFAULT;
 
 	return 0;
 }
 
+static void ubbd_eventfd_signal(struct eventfd_ctx *ctx)
+{
+#ifdef HAVE_EVENTFD_SIGNAL_NO_COUNT
+	eventfd_signal(ctx);
+#else
+	eventfd_signal(ctx, 1);
+#endif /* HAVE_EVENTFD_SIGNAL_NO_COUNT */
+}
+
+/* tell the backend about new SEs, through the kring and the cmd eventfd */
+void ubbd_queue_notify(struct ubbd_queue *ubbd_q)
+{
+	struct eventfd_ctx *ctx;
+
+	ubbd_kring_event_notify(&ubbd_q->ubbd_kring_info);
+
+	rcu_read_lock();
+	ctx = rcu_dereference(ubbd_q->cmd_efd);
+	if (ctx)
+		ubbd_eventfd_signal(ctx);
+	rcu_read_unlock();
+}
+
+static void ubbd_compr_efd_kick(struct ubbd_queue *ubbd_q)
+{
+	if (ubbd_queue_is_poll(ubbd_q) ||
+			atomic_read(&ubbd_q->status) == UBBD_QUEUE_KSTATUS_REMOVING)
+		return;
+
+	atomic64_inc(&ubbd_q->complete_kicks);
+	if (ubbd_q->ubbd_dev->complete_ctx == UBBD_COMPLETE_CTX_INLINE)
+		queue_work(ubbd_wq, &ubbd_q->complete_work);
+	else
+		ubbd_queue_kick_complete(ubbd_q);
+}
+
+/* called under the wait queue lock of the eventfd, so never complete inline */
+static int ubbd_compr_efd_wakeup(wait_queue_entry_t *wait, unsigned int mode,
+		int sync, void *key)
+{
+	struct ubbd_queue *ubbd_q = container_of(wait, struct ubbd_queue, compr_efd_wait);
+#ifdef HAVE_EVENTFD_CTX_DO_READ
+	u64 cnt;
+#endif /* HAVE_EVENTFD_CTX_DO_READ */
+
+	if (!(key_to_poll(key) & EPOLLIN))
+		return 0;
+
+#ifdef HAVE_EVENTFD_CTX_DO_READ
+	/* the kick is all we need, don't let the count build up */
+	eventfd_ctx_do_read(ubbd_q->compr_efd, &cnt);
+#endif /* HAVE_EVENTFD_CTX_DO_READ */
+	ubbd_compr_efd_kick(ubbd_q);
+
+	return 0;
+}
+
+static void ubbd_compr_efd_ptable_queue(struct file *file, wait_queue_head_t *wqh,
+		poll_table *pt)
+{
+	struct ubbd_queue *ubbd_q = container_of(pt, struct ubbd_queue, compr_efd_pt);
+
+	add_wait_queue(wqh, &ubbd_q->compr_efd_wait);
+}
+
+static void ubbd_queue_clear_eventfds(struct ubbd_queue *ubbd_q)
+{
+	struct eventfd_ctx *ctx;
+	u64 cnt;
+
+	ctx = rcu_dereference_protected(ubbd_q->cmd_efd,
+			lockdep_is_held(&ubbd_q->state_lock));
+	if (ctx) {
+		rcu_assign_pointer(ubbd_q->cmd_efd, NULL);
+		synchronize_rcu();
+		eventfd_ctx_put(ctx);
+	}
+
+	if (ubbd_q->compr_efd) {
+		eventfd_ctx_remove_wait_queue(ubbd_q->compr_efd, &ubbd_q->compr_efd_wait, &cnt);
+		eventfd_ctx_put(ubbd_q->compr_efd);
+		ubbd_q->compr_efd = NULL;
+	}
+}
+
+static int ubbd_queue_set_compr_efd(struct ubbd_queue *ubbd_q, int fd)
+{
+	struct eventfd_ctx *ctx;
+	struct file *file;
+	__poll_t events;
+
+	file = fget(fd);
+	if (!file)
+		return -EBADF;
+
+	ctx = eventfd_ctx_fileget(file);
+	if (IS_ERR(ctx)) {
+		fput(file);
+		return PTR_ERR(ctx);
+	}
+
+	ubbd_q->compr_efd = ctx;
+	init_waitqueue_func_entry(&ubbd_q->compr_efd_wait, ubbd_compr_efd_wakeup);
+	init_poll_funcptr(&ubbd_q->compr_efd_pt, ubbd_compr_efd_ptable_queue);
+	events = vfs_poll(file, &ubbd_q->compr_efd_pt);
+	fput(file);
+
+	/* the backend may have posted CEs and written compr_fd already */
+	if (events & EPOLLIN)
+		ubbd_compr_efd_kick(ubbd_q);
+
+	return 0;
+}
+
+static long ubbd_queue_set_eventfd(struct ubbd_queue *ubbd_q,
+		struct ubbd_kring_eventfd __user *uarg)
+{
+	struct ubbd_kring_eventfd efd;
+	struct eventfd_ctx *ctx;
+	int ret = 0;
+
+	if (copy_from_user(&efd, uarg, sizeof(efd)))
+		return -EFAULT;
+
+	mutex_lock(&ubbd_q->state_lock);
+	/* ubbd_queue_kring_stop() already detached them for good */
+	if (atomic_read(&ubbd_q->status) == UBBD_QUEUE_KSTATUS_REMOVING) {
+		ret = -ENODEV;
+		goto out;
+	}
+
+	ubbd_queue_clear_eventfds(ubbd_q);
+
+	if (efd.cmd_fd >= 0) {
+		ctx = eventfd_ctx_fdget(efd.cmd_fd);
+		if (IS_ERR(ctx)) {
+			ret = PTR_ERR(ctx);
+			goto out;
+		}
+		rcu_assign_pointer(ubbd_q->cmd_efd, ctx);
+	}
+
+	if (efd.compr_fd >= 0) {
+		ret = ubbd_queue_set_compr_efd(ubbd_q, efd.compr_fd);
+		if (ret)
+			goto err_clear;
+	}
+out:
+	mutex_unlock(&ubbd_q->state_lock);
+	return ret;
+
+err_clear:
+	ubbd_queue_clear_eventfds(ubbd_q);
+	goto out;
+}
+
+static long ubbd_kring_dev_ioctl(struct ubbd_kring_info *info, unsigned int cmd,
+		unsigned long arg)
+{
+	struct ubbd_queue *ubbd_q = container_of(info, struct ubbd_queue, ubbd_kring_info);
+
+	switch (cmd) {
+	case UBBD_KRING_IOC_REAP_AND_WAIT:
+		return ubbd_queue_reap_and_wait(ubbd_q, (void __user *)arg);
+	case UBBD_KRING_IOC_SET_EVENTFD:
+		return ubbd_queue_set_eventfd(ubbd_q, (void __user *)arg);
+	default:
+		return -ENOTTY;
+	}
+}
+
+#ifdef HAVE_URING_CMD
+static void ubbd_fetch_done_cb(struct io_uring_cmd *cmd, unsigned int issue_flags)
+{
+	io_uring_cmd_done(cmd, ubbd_fetch_pdu(cmd)->res, 0, issue_flags);
+}
+
+/*
+ * Complete all parked FETCH cmds with res. Called after cmd_head is
+ * published, possibly in atomic context, so the CQEs are posted from
+ * task work.
+ */
+void ubbd_queue_complete_fetch(struct ubbd_queue *ubbd_q, int res)
+{
+	struct ubbd_fetch_pdu *pdu, *next;
+
+	spin_lock(&ubbd_q->fetch_lock);
+	list_for_each_entry_safe(pdu, next, &ubbd_q->fetch_cmds, node) {
+		list_del_init(&pdu->node);
+		pdu->res = res;
+		WRITE_ONCE(pdu->completing, true);
+		io_uring_cmd_complete_in_task(pdu->cmd, ubbd_fetch_done_cb);
+	}
+	spin_unlock(&ubbd_q->fetch_lock);
+}
+
+static int ubbd_queue_fetch(struct ubbd_queue *ubbd_q, struct io_uring_cmd *cmd,
+		unsigned int issue_flags)
+{
+	const struct ubbd_uring_cmd *ucmd = io_uring_sqe_cmd(cmd->sqe);
+	struct ubbd_fetch_pdu *pdu = ubbd_fetch_pdu(cmd);
+	u32 cmd_tail = READ_ONCE(ucmd->cmd_tail);
+	u32 head;
+
+	head = smp_load_acquire(ubbd_q->sb_cmd_head);
+	if (head != cmd_tail)
+		return head;
+
+	pdu->cmd = cmd;
+	pdu->completing = false;
+	INIT_LIST_HEAD(&pdu->node);
+
+	/* may sleep, so before fetch_lock. io_uring cancels it when the ring exits */
+	io_uring_cmd_mark_cancelable(cmd, issue_flags);
+
+	spin_lock(&ubbd_q->fetch_lock);
+	/* ubbd_queue_kring_stop() completed the parked cmds already */
+	if (atomic_read(&ubbd_q->status) == UBBD_QUEUE_KSTATUS_REMOVING) {
+		spin_unlock(&ubbd_q->fetch_lock);
+		io_uring_cmd_done(cmd, -ENODEV, 0, issue_flags);
+		return -EIOCBQUEUED;
+	}
+
+	/*
+	 * Park first, then look at cmd_head again. ubbd_queue_commit()
+	 * publishes cmd_head before it checks fetch_cmds, so one of us sees
+	 * the other.
+	 */
+	list_add_tail(&pdu->node, &ubbd_q->fetch_cmds);
+	smp_mb();
+	head = READ_ONCE(*ubbd_q->sb_cmd_head);
+	if (head == cmd_tail) {
+		spin_unlock(&ubbd_q->fetch_lock);
+		return -EIOCBQUEUED;
+	}
+	list_del_init(&pdu->node);
+	spin_unlock(&ubbd_q->fetch_lock);
+
+	io_uring_cmd_done(cmd, head, 0, issue_flags);
+
+	return -EIOCBQUEUED;
+}
+
+static void ubbd_queue_fetch_cancel(struct ubbd_queue *ubbd_q, struct io_uring_cmd *cmd,
+		unsigned int issue_flags)
+{
+	struct ubbd_fetch_pdu *pdu = ubbd_fetch_pdu(cmd);
+	bool parked;
+
+	spin_lock(&ubbd_q->fetch_lock);
+	/* otherwise ubbd_queue_complete_fetch() already took it */
+	parked = !list_empty(&pdu->node);
+	list_del_init(&pdu->node);
+	spin_unlock(&ubbd_q->fetch_lock);
+
+	if (parked)
+		io_uring_cmd_done(cmd, -ECANCELED, 0, issue_flags);
+}
+
+static int ubbd_uring_cmd(struct ubbd_kring_info *info, struct io_uring_cmd *cmd,
+		unsigned int issue_flags)
+{
+	struct ubbd_queue *ubbd_q = container_of(info, struct ubbd_queue, ubbd_kring_info);
+
+	if (issue_flags & IO_URING_F_CANCEL) {
+		ubbd_queue_fetch_cancel(ubbd_q, cmd, issue_flags);
+		return 0;
+	}
+
+	switch (cmd->cmd_op) {
+	case UBBD_URING_CMD_COMMIT_AND_FETCH:
+		ubbd_irqcontrol(info, 0);
+		fallthrough;
+	case UBBD_URING_CMD_FETCH:
+		return ubbd_queue_fetch(ubbd_q, cmd, issue_flags);
+	default:
+		return -EINVAL;
+	}
+}
+#endif /* HAVE_URING_CMD */
+
 static void ubbd_vma_open(struct vm_area_struct *vma)
 {
 	struct ubbd_queue *ubbd_q = vma->vm_private_data;
@@ -635,6 +1330,32 @@ static struct page *ubbd_try_get_data_page(struct ubbd_queue *ubbd_q, uint32_t d
 	return page;
 }
 
+/*
+ * In zerocopy mode a data slot may hold a page owned by the bio, which has
+ * to be unmapped before the request is ended. Insert the pte under
+ * pages_mutex, so a fault can't map the page again behind the unmap in
+ * ubbd_release_page().
+ */
+static vm_fault_t ubbd_vma_zc_fault(struct ubbd_queue *ubbd_q,
+		struct vm_fault *vmf, uint32_t dpi)
+{
+	struct page *page;
+	vm_fault_t ret;
+
+	mutex_lock(&ubbd_q->pages_mutex);
+	page = ubbd_try_get_data_page(ubbd_q, dpi);
+	if (!page) {
+		ret = VM_FAULT_SIGBUS;
+		goto out;
+	}
+
+	ret = vmf_insert_page(vmf->vma, vmf->address, page);
+	ubbd_queue_debug(ubbd_q, "ubbd ubbd_kring zc fault page: %p, ret: %u", page, ret);
+out:
+	mutex_unlock(&ubbd_q->pages_mutex);
+	return ret;
+}
+
 static vm_fault_t ubbd_vma_fault(struct vm_fault *vmf)
 {
 	struct ubbd_queue *ubbd_q = vmf->vma->vm_private_data;
@@ -652,6 +1373,9 @@ static vm_fault_t ubbd_vma_fault(struct vm_fault *vmf)
 		uint32_t dpi;
 
 		dpi = (offset - ubbd_q->data_off) / PAGE_SIZE;
+		if (ubbd_dev_zerocopy(ubbd_q->ubbd_dev))
+			return ubbd_vma_zc_fault(ubbd_q, vmf, dpi);
+
 		page = ubbd_try_get_data_page(ubbd_q, dpi);
 		if (!page)
 			return VM_FAULT_SIGBUS;
@@ -673,11 +1397,16 @@ static const struct vm_operations_struct ubbd_vm_ops = {
 static int ubbd_kring_dev_mmap(struct ubbd_kring_info *info, struct vm_area_struct *vma)
 {
 	struct ubbd_queue *ubbd_q = container_of(info, struct ubbd_queue, ubbd_kring_info);
+	unsigned long vm_flags = VM_DONTEXPAND | VM_DONTDUMP;
+
+	/* vmf_insert_page() in ubbd_vma_zc_fault() needs VM_MIXEDMAP */
+	if (ubbd_dev_zerocopy(ubbd_q->ubbd_dev))
+		vm_flags |= VM_MIXEDMAP;
 
 #ifdef HAVE_VM_FLAGS_SET
-	vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP);
+	vm_flags_set(vma, vm_flags);
 #else
-	vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+	vma->vm_flags |= vm_flags;
 #endif /* HAVE_VM_FLAGS_SET */
 	vma->vm_ops = &ubbd_vm_ops;
 	vma->vm_private_data = ubbd_q;
@@ -731,6 +1460,10 @@ int ubbd_queue_kring_init(struct ubbd_queue *ubbd_q)
 	info->mem[0].size = ubbd_q->mmap_pages << PAGE_SHIFT;
 
 	info->irqcontrol = ubbd_irqcontrol;
+	info->ioctl = ubbd_kring_dev_ioctl;
+#ifdef HAVE_URING_CMD
+	info->uring_cmd = ubbd_uring_cmd;
+#endif /* HAVE_URING_CMD */
 
 	info->mmap = ubbd_kring_dev_mmap;
 	info->open = ubbd_kring_dev_open;
@@ -743,6 +1476,29 @@ int ubbd_queue_kring_init(struct ubbd_queue *ubbd_q)
 	return ubbd_kring_register_device(ubbd_kring_root_device, info);
 }
 
+/*
+ * The queue is removing, let waiters of the backend go, they hold
+ * idev->srcu and ubbd_kring_unregister_device() waits for them.
+ * Detach the eventfds too, so nothing kicks the complete work once the
+ * caller cancelled it.
+ */
+void ubbd_queue_kring_stop(struct ubbd_queue *ubbd_q)
+{
+	struct ubbd_kring_info *info = &ubbd_q->ubbd_kring_info;
+
+	if (!info->ubbd_kring_dev)
+		return;
+
+	atomic_set(&ubbd_q->status, UBBD_QUEUE_KSTATUS_REMOVING);
+	wake_up_all(&ubbd_q->cmd_wait);
+#ifdef HAVE_URING_CMD
+	ubbd_queue_complete_fetch(ubbd_q, -ENODEV);
+#endif /* HAVE_URING_CMD */
+	mutex_lock(&ubbd_q->state_lock);
+	ubbd_queue_clear_eventfds(ubbd_q);
+	mutex_unlock(&ubbd_q->state_lock);
+}
+
 void ubbd_queue_kring_destroy(struct ubbd_queue *ubbd_q)
 {
 	struct ubbd_kring_info *info = &ubbd_q->ubbd_kring_info;
@@ -754,5 +1510,10 @@ void ubbd_queue_kring_destroy(struct ubbd_queue *ubbd_q)
 void ubbd_kring_unmap_range(struct ubbd_queue *ubbd_q,
 		loff_t const holebegin, loff_t const holelen, int even_cows)
 {
+	/* nothing can be mapped before the backend opened the kring */
+	if (!ubbd_q->inode)
+		return;
+
 	unmap_mapping_range(ubbd_q->inode->i_mapping, holebegin, holelen, even_cows);
+	atomic64_inc(&ubbd_q->data_unmaps);
 }
@@ -31,6 +31,12 @@ static inline size_t get_queue_msg_size(struct ubbd_queue *ubbd_q)
 	/* UBBD_QUEUE_INFO_STATUS */
 	msg_size += nla_attr_size(sizeof(s32));
 
+	/* UBBD_QUEUE_INFO_POLL */
+	msg_size += nla_attr_size(0);
+
+	/* UBBD_QUEUE_INFO_NUMA_NODE */
+	msg_size += nla_attr_size(sizeof(s32));
+
 	/* size for each cpu  */
 	cpulist_size = nla_attr_size(sizeof(u32)) * cpumask_weight(&ubbd_q->cpumask);
 
@@ -110,18 +116,25 @@ err:
 	return -EMSGSIZE;
 }
 
-static struct nla_policy ubbd_dev_opts_attr_policy[UBBD_DEV_OPTS_MAX+1] = {
+static struct nla_policy ubbd_dev_opts_attr_policy[UBBD_DEV_OPTS_EXT_MAX+1] = {
 	[UBBD_DEV_OPTS_DP_RESERVE]	= { .type = NLA_U32 },
 	[UBBD_DEV_OPTS_DEV_SIZE]		= { .type = NLA_U64 },
 	[UBBD_DEV_OPTS_DATA_PAGES]		= { .type = NLA_U32 },
 	[UBBD_DEV_OPTS_DEV_QUEUES]		= { .type = NLA_U32 },
 	[UBBD_DEV_OPTS_IO_TIMEOUT]		= { .type = NLA_U32 },
+	[UBBD_DEV_OPTS_COMPLETE_CTX]		= { .type = NLA_U32 },
+	[UBBD_DEV_OPTS_POLL_QUEUES]		= { .type = NLA_U32 },
+	[UBBD_DEV_OPTS_COMPLETE_POLL_US]		= { .type = NLA_U32 },
+	[UBBD_DEV_OPTS_INLINE_DATA_MAX]		= { .type = NLA_U32 },
+	[UBBD_DEV_OPTS_CMDR_SIZE]		= { .type = NLA_U32 },
+	[UBBD_DEV_OPTS_COMPR_SIZE]		= { .type = NLA_U32 },
+	[UBBD_DEV_OPTS_QUEUE_DEPTH]		= { .type = NLA_U32 },
 };
 
 static int handle_cmd_add_dev(struct sk_buff *skb, struct genl_info *info)
 {
 	struct ubbd_device *ubbd_dev = NULL;
-	struct nlattr *dev_opts[UBBD_DEV_OPTS_MAX + 1];
+	struct nlattr *dev_opts[UBBD_DEV_OPTS_EXT_MAX + 1];
 	struct ubbd_dev_add_opts add_opts = {0};
 	int ret = 0;
 
@@ -133,7 +146,7 @@ static int handle_cmd_add_dev(struct sk_buff *skb, struct genl_info *info)
 
 	add_opts.dev_features = nla_get_u64(info->attrs[UBBD_ATTR_FLAGS]);
 
-	ret = ubbd_nla_parse_nested(dev_opts, UBBD_DEV_OPTS_MAX,
+	ret = ubbd_nla_parse_nested(dev_opts, UBBD_DEV_OPTS_EXT_MAX,
 			info->attrs[UBBD_ATTR_DEV_OPTS],
 			ubbd_dev_opts_attr_policy,
 			info->extack);
@@ -165,6 +178,105 @@ static int handle_cmd_add_dev(struct sk_buff *skb, struct genl_info *info)
 	if (!add_opts.io_timeout)
 		add_opts.io_timeout = UINT_MAX;
 
+	if (dev_opts[UBBD_DEV_OPTS_COMPLETE_CTX])
+		add_opts.complete_ctx = nla_get_u32(dev_opts[UBBD_DEV_OPTS_COMPLETE_CTX]);
+
+	if (dev_opts[UBBD_DEV_OPTS_POLL_QUEUES])
+		add_opts.poll_queues = nla_get_u32(dev_opts[UBBD_DEV_OPTS_POLL_QUEUES]);
+
+	if (dev_opts[UBBD_DEV_OPTS_COMPLETE_POLL_US])
+		add_opts.complete_poll_us = nla_get_u32(dev_opts[UBBD_DEV_OPTS_COMPLETE_POLL_US]);
+
+	if (dev_opts[UBBD_DEV_OPTS_INLINE_DATA_MAX])
+		add_opts.inline_data_max = nla_get_u32(dev_opts[UBBD_DEV_OPTS_INLINE_DATA_MAX]);
+
+	if (dev_opts[UBBD_DEV_OPTS_CMDR_SIZE])
+		add_opts.cmdr_size = nla_get_u32(dev_opts[UBBD_DEV_OPTS_CMDR_SIZE]);
+	else
+		add_opts.cmdr_size = CMDR_SIZE;
+
+	if (dev_opts[UBBD_DEV_OPTS_COMPR_SIZE])
+		add_opts.compr_size = nla_get_u32(dev_opts[UBBD_DEV_OPTS_COMPR_SIZE]);
+	else
+		add_opts.compr_size = COMPR_SIZE;
+
+	if (dev_opts[UBBD_DEV_OPTS_QUEUE_DEPTH])
+		add_opts.queue_depth = nla_get_u32(dev_opts[UBBD_DEV_OPTS_QUEUE_DEPTH]);
+	else
+		add_opts.queue_depth = UBBD_QUEUE_DEPTH_DEFAULT;
+
+#ifndef HAVE_IO_COMP_BATCH
+	if (add_opts.poll_queues) {
+		ubbd_err("poll queues are not supported by this kernel");
+		ret = -EOPNOTSUPP;
+		goto out;
+	}
+#endif /* HAVE_IO_COMP_BATCH */
+
+	/* req_tid has 16 bits for the hctx index */
+	if (add_opts.num_queues + add_opts.poll_queues > U16_MAX + 1) {
+		ubbd_err("too many queues: %u + %u", add_opts.num_queues,
+				add_opts.poll_queues);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	if (add_opts.complete_ctx >= __UBBD_COMPLETE_CTX_MAX) {
+		ubbd_err("invalid complete_ctx: %u", add_opts.complete_ctx);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	if (add_opts.complete_poll_us &&
+			(add_opts.complete_ctx != UBBD_COMPLETE_CTX_KTHREAD ||
+			 add_opts.complete_poll_us > UBBD_COMPLETE_POLL_US_MAX)) {
+		ubbd_err("invalid complete_poll_us: %u for complete_ctx: %u",
+				add_opts.complete_poll_us, add_opts.complete_ctx);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	if (add_opts.inline_data_max > UBBD_INLINE_DATA_MAX) {
+		ubbd_err("invalid inline_data_max: %u", add_opts.inline_data_max);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	if (!add_opts.cmdr_size || !PAGE_ALIGNED(add_opts.cmdr_size) ||
+			add_opts.cmdr_size > UBBD_RING_SIZE_MAX ||
+			!add_opts.compr_size || !PAGE_ALIGNED(add_opts.compr_size) ||
+			add_opts.compr_size > UBBD_RING_SIZE_MAX) {
+		ubbd_err("invalid ring size: cmdr %u compr %u",
+				add_opts.cmdr_size, add_opts.compr_size);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	if (!add_opts.queue_depth || add_opts.queue_depth > UBBD_QUEUE_DEPTH_MAX) {
+		ubbd_err("invalid queue_depth: %u", add_opts.queue_depth);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	/* every tag must find room in both rings, so they never run full */
+	if (ubbd_cmdr_se_capacity(add_opts.cmdr_size, add_opts.dev_features,
+				add_opts.inline_data_max) < add_opts.queue_depth ||
+			add_opts.compr_size / sizeof(struct ubbd_ce) <= add_opts.queue_depth) {
+		ubbd_err("rings too small for queue_depth %u: cmdr %u compr %u",
+				add_opts.queue_depth, add_opts.cmdr_size,
+				add_opts.compr_size);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	/* a single page has to fit in the u16 len of an extent */
+	if ((add_opts.dev_features & UBBD_ATTR_FLAGS_ADD_COMPACT_SE) &&
+			PAGE_SIZE > U16_MAX) {
+		ubbd_err("compact se is not supported with PAGE_SIZE %lu", PAGE_SIZE);
+		ret = -EOPNOTSUPP;
+		goto out;
+	}
+
 	if (ubbd_mgmt_need_fault()) {
 		ret = -ENOMEM;
 		goto out;
@@ -317,7 +429,13 @@ static int fill_queue_info_item(struct ubbd_queue *ubbd_q, struct sk_buff *reply
 		nla_put_s32(reply_skb, UBBD_QUEUE_INFO_B_PID,
 				ubbd_q->backend_pid) ||
 		nla_put_s32(reply_skb, UBBD_QUEUE_INFO_STATUS,
-				atomic_read(&ubbd_q->status)))
+				atomic_read(&ubbd_q->status)) ||
+		nla_put_s32(reply_skb, UBBD_QUEUE_INFO_NUMA_NODE,
+				ubbd_q->numa_node))
+		return -EMSGSIZE;
+
+	if (ubbd_queue_is_poll(ubbd_q) &&
+			nla_put_flag(reply_skb, UBBD_QUEUE_INFO_POLL))
 		return -EMSGSIZE;
 
 	cpu_list = nla_nest_start(reply_skb, UBBD_QUEUE_INFO_CPU_LIST);
@@ -1,32 +1,24 @@
 #include "ubbd_internal.h"
 #include <linux/delay.h>
+#include <linux/sort.h>
 
 static struct ubbd_se *get_submit_entry(struct ubbd_queue *ubbd_q)
 {
 	struct ubbd_se *se;
 
-	ubbd_dev_debug(ubbd_q->ubbd_dev, "get se head : %u", ubbd_q->sb_addr->cmd_head);
-	se = (struct ubbd_se *)(ubbd_q->cmdr + ubbd_q->sb_addr->cmd_head);
+	ubbd_dev_debug(ubbd_q->ubbd_dev, "get se head : %u", ubbd_q->cmd_head);
+	se = (struct ubbd_se *)(ubbd_q->cmdr + ubbd_q->cmd_head);
 
 	return se;
 }
 
 static struct ubbd_se *get_oldest_se(struct ubbd_queue *ubbd_q)
 {
-	if (ubbd_q->sb_addr->cmd_tail == ubbd_q->sb_addr->cmd_head)
+	if (*ubbd_q->sb_cmd_tail == ubbd_q->cmd_head)
 		return NULL;
 
-	ubbd_dev_debug(ubbd_q->ubbd_dev, "get tail se: %u", ubbd_q->sb_addr->cmd_tail);
-	return (struct ubbd_se *)(ubbd_q->cmdr + ubbd_q->sb_addr->cmd_tail);
-}
-
-static struct ubbd_ce *get_complete_entry(struct ubbd_queue *ubbd_q)
-{
-	if (ubbd_q->sb_addr->compr_tail == ubbd_q->sb_addr->compr_head)
-		return NULL;
-
-	ubbd_dev_debug(ubbd_q->ubbd_dev, "get complete entry: %u, head: %u", ubbd_q->sb_addr->compr_tail, ubbd_q->sb_addr->compr_head);
-	return (struct ubbd_ce *)(ubbd_q->compr + ubbd_q->sb_addr->compr_tail);
+	ubbd_dev_debug(ubbd_q->ubbd_dev, "get tail se: %u", *ubbd_q->sb_cmd_tail);
+	return (struct ubbd_se *)(ubbd_q->cmdr + *ubbd_q->sb_cmd_tail);
 }
 
 static uint32_t ubbd_req_get_pi(struct ubbd_request *req, uint32_t bvec_index)
@@ -45,20 +37,52 @@ static void ubbd_req_set_pi(struct ubbd_request *req, uint32_t index, int value)
 		req->pi[index - UBBD_REQ_INLINE_PI_MAX] = value;
 }
 
-static struct page *ubbd_alloc_page(struct ubbd_queue *ubbd_q)
+/* a page left by ubbd_queue_prealloc_fn() */
+static struct page *ubbd_get_prealloc_page(struct ubbd_queue *ubbd_q)
+{
+	struct page *page;
+
+	if (list_empty_careful(&ubbd_q->prealloc_pages))
+		return NULL;
+
+	spin_lock(&ubbd_q->prealloc_lock);
+	page = list_first_entry_or_null(&ubbd_q->prealloc_pages, struct page, lru);
+	if (page)
+		list_del(&page->lru);
+	spin_unlock(&ubbd_q->prealloc_lock);
+
+	return page;
+}
+
+static struct page *ubbd_alloc_page(struct ubbd_queue *ubbd_q, gfp_t gfp)
 {
 	struct page *page;
 
 	if (ubbd_req_need_fault())
 		return NULL;
 
-	page = alloc_page(GFP_NOIO);
+	/* counted once it is cached in a slot, the shrinker can reclaim it then */
+	page = ubbd_get_prealloc_page(ubbd_q);
+	if (page)
+		goto out;
+
+	/*
+	 * The page pool is only for the GFP_NOIO retry from task_wq, the
+	 * inline GFP_NOWAIT attempt must not eat into its reserve.
+	 */
+	if (ubbd_q->page_pool && gfpflags_allow_blocking(gfp)) {
+		page = mempool_alloc(ubbd_q->page_pool, gfp);
+		if (READ_ONCE(ubbd_q->page_pool->curr_nr) < ubbd_q->page_pool->min_nr)
+			queue_work(system_unbound_wq, &ubbd_q->pool_refill_work);
+	} else {
+		page = alloc_pages_node(ubbd_q->numa_node, gfp, 0);
+	}
 	if (!page) {
 		return NULL;
 	}
-
+out:
+	atomic_inc(&ubbd_q->data_pages_allocated);
 	ubbd_dev_debug(ubbd_q->ubbd_dev, "alloc page: %p", page);
-	ubbd_q->data_pages_allocated++;
 
 	return page;
 }
@@ -66,8 +90,11 @@ static struct page *ubbd_alloc_page(struct ubbd_queue *ubbd_q)
 static void __ubbd_release_page(struct ubbd_queue *ubbd_q, struct page *page)
 {
 	ubbd_dev_debug(ubbd_q->ubbd_dev, "release page: %p", page);
-	__free_page(page);
-	ubbd_q->data_pages_allocated--;
+	if (ubbd_q->page_pool)
+		mempool_free(page, ubbd_q->page_pool);
+	else
+		__free_page(page);
+	atomic_dec(&ubbd_q->data_pages_allocated);
 }
 
 static void ubbd_release_page(struct ubbd_queue *ubbd_q,
@@ -79,83 +106,160 @@ static void ubbd_release_page(struct ubbd_queue *ubbd_q,
 	ubbd_dev_debug(ubbd_q->ubbd_dev, "release page: %u, req: %p, bvec_index: %u ",
 			page_index, ubbd_req, bvec_index);
 
-	mutex_lock(&ubbd_q->pages_mutex);
-	clear_bit(page_index, ubbd_q->data_bitmap);
-	if (ubbd_q->data_pages_allocated > ubbd_q->data_pages_reserved) {
+	/*
+	 * In zerocopy mode the data area never caches pages: a slot holds
+	 * either a bio page or a bounce page only while its request is in
+	 * flight, so we always unmap it here. Otherwise the page stays with
+	 * the slot until ubbd_dev_shrink_scan() reclaims it.
+	 */
+	if (!ubbd_dev_zerocopy(ubbd_q->ubbd_dev)) {
+		set_bit(page_index, ubbd_q->data_ref);
+	} else {
 		loff_t off;
 
+		mutex_lock(&ubbd_q->pages_mutex);
 		page = xa_load(&ubbd_q->data_pages_array, page_index);
 		if (!page)
-			goto out;
+			goto unlock;
 
-		off = ubbd_q->data_off + page_index * 4096;
-		ubbd_kring_unmap_range(ubbd_q, off, 2, 1);
+		off = ubbd_q->data_off + ((loff_t)page_index << PAGE_SHIFT);
+		ubbd_kring_unmap_range(ubbd_q, off, PAGE_SIZE, 1);
 
 		xa_erase(&ubbd_q->data_pages_array, page_index);
-		__ubbd_release_page(ubbd_q, page);
+		if (!test_bit(UBBD_REQ_FLAGS_ZEROCOPY, &ubbd_req->flags))
+			__ubbd_release_page(ubbd_q, page);
+unlock:
+		mutex_unlock(&ubbd_q->pages_mutex);
 	}
-out:
-	mutex_unlock(&ubbd_q->pages_mutex);
+
+	/*
+	 * Give the slot back only after its page is settled, the next owner
+	 * of this slot expects to find either a cached page or nothing.
+	 */
+	sbitmap_queue_clear(&ubbd_q->data_sbq, page_index, raw_smp_processor_id());
+}
+
+/*
+ * Called wherever cmd ring space, SE slots or data slots are given back:
+ * completions, ubbd_req_release() and the shrinker. Restarts the hctxs
+ * stopped by ubbd_req_wait_res().
+ */
+static void ubbd_queue_restart(struct ubbd_queue *ubbd_q)
+{
+	atomic_inc(&ubbd_q->res_seq);
+	/* pairs with smp_mb__after_atomic() in ubbd_req_wait_res() */
+	smp_mb__after_atomic();
+	if (!test_bit(UBBD_QUEUE_FLAGS_WAIT_RES, &ubbd_q->flags) ||
+			!test_and_clear_bit(UBBD_QUEUE_FLAGS_WAIT_RES, &ubbd_q->flags))
+		return;
+
+	blk_mq_start_stopped_hw_queues(ubbd_q->ubbd_dev->disk->queue, true);
+	blk_mq_kick_requeue_list(ubbd_q->ubbd_dev->disk->queue);
 }
 
 static int ubbd_xa_store_page(struct ubbd_queue *ubbd_q, int page_index,
-		struct page *page)
+		struct page *page, gfp_t gfp)
 {
 	if (ubbd_req_need_fault())
 		return -ENOMEM;
 
 	return xa_err(xa_store(&ubbd_q->data_pages_array,
-				page_index, page, GFP_NOIO));
+				page_index, page, gfp));
 }
 
-static int ubbd_get_data_pages(struct ubbd_queue *ubbd_q, struct ubbd_request *req)
+/*
+ * Reserve data area slots for all segments of a request. The slots come
+ * from a per-queue sbitmap_queue, so this is lock-free and spreads
+ * concurrent submitters over the bitmap with per-cpu allocation hints.
+ */
+static int ubbd_get_data_slots(struct ubbd_queue *ubbd_q, struct ubbd_request *req)
 {
-	struct page *page, *new_page = NULL;
+	uint32_t got = 0;
+	int page_index;
+
+	if (ubbd_req_need_fault())
+		return -ENOMEM;
+
+	while (got < req->pi_cnt) {
+		page_index = __sbitmap_queue_get(&ubbd_q->data_sbq);
+		if (page_index < 0)
+			goto err;
+
+		ubbd_req_set_pi(req, got++, page_index);
+	}
+
+	/*
+	 * The shrinker may be dropping the page of a slot we got, back off
+	 * until it is done. It restarts us then, see ubbd_queue_shrink().
+	 * Pairs with smp_mb__after_atomic() in ubbd_data_slot_claim().
+	 */
+	smp_mb();
+	for (page_index = 0; page_index < got; page_index++) {
+		if (unlikely(test_bit(ubbd_req_get_pi(req, page_index), ubbd_q->data_reclaim)))
+			goto err;
+	}
+
+	return 0;
+err:
+	while (got > 0)
+		sbitmap_queue_clear(&ubbd_q->data_sbq, ubbd_req_get_pi(req, --got),
+				raw_smp_processor_id());
+
+	atomic64_inc(&ubbd_q->data_full);
+	return -ENOSPC;
+}
+
+/*
+ * On failure the slots stay with the request, it is up to the caller to
+ * give them back with ubbd_req_release() from a context that can sleep.
+ */
+static int ubbd_get_data_pages(struct ubbd_queue *ubbd_q, struct ubbd_request *req,
+		gfp_t gfp)
+{
+	struct page *page;
 	int bvec_index = 0, page_index = 0;
 	struct bio_vec bv;
 	struct bvec_iter iter;
 	struct bio *bio = req->req->bio;
 	int ret = 0;
 
+	ret = ubbd_get_data_slots(ubbd_q, req);
+	if (ret) {
+		ubbd_debug("cant find empty page\n");
+		return ret;
+	}
+	set_bit(UBBD_REQ_FLAGS_DATA_SLOTS, &req->flags);
+
+	/* the slots are ours now, make sure every one of them has a page */
 next_bio:
 	bio_for_each_segment(bv, bio, iter) {
-again:
-		mutex_lock(&ubbd_q->pages_mutex);
-		page_index = find_first_zero_bit(ubbd_q->data_bitmap, ubbd_q->data_pages);
-		if (page_index == ubbd_q->data_pages) {
-			mutex_unlock(&ubbd_q->pages_mutex);
-			ubbd_debug("cant find empty page\b");
-			ret = -ENOMEM;
-			goto out;
+		page_index = ubbd_req_get_pi(req, bvec_index++);
+
+		if (test_bit(UBBD_REQ_FLAGS_ZEROCOPY, &req->flags)) {
+			/* hand the bio page itself to the backend */
+			ret = ubbd_xa_store_page(ubbd_q, page_index, bv.bv_page, gfp);
+			if (ret) {
+				ubbd_dev_debug(ubbd_q->ubbd_dev, "xa_store failed.");
+				return ret;
+			}
+			continue;
 		}
 
-		page = xa_load(&ubbd_q->data_pages_array, page_index);
+		if (xa_load(&ubbd_q->data_pages_array, page_index))
+			continue;
+
+		page = ubbd_alloc_page(ubbd_q, gfp);
 		if (!page) {
-			if (new_page) {
-				page = new_page;
-				new_page = NULL;
-				ret = ubbd_xa_store_page(ubbd_q, page_index, page);
-				if (ret) {
-					mutex_unlock(&ubbd_q->pages_mutex);
-					ubbd_dev_err(ubbd_q->ubbd_dev, "xa_store failed.");
-					__ubbd_release_page(ubbd_q, page);
-					goto out;
-				}
-			} else {
-				mutex_unlock(&ubbd_q->pages_mutex);
-				new_page = ubbd_alloc_page(ubbd_q);
-				if (!new_page) {
-					ubbd_dev_err(ubbd_q->ubbd_dev, "failed to alloc page.");
-					ret = -ENOMEM;
-					goto out;
-				}
-				goto again;
-			}
+			ubbd_dev_debug(ubbd_q->ubbd_dev, "failed to alloc page.");
+			return -ENOMEM;
 		}
 
-		set_bit(page_index, ubbd_q->data_bitmap);
-		mutex_unlock(&ubbd_q->pages_mutex);
-		ubbd_req_set_pi(req, bvec_index++, page_index);
+		ret = ubbd_xa_store_page(ubbd_q, page_index, page, gfp);
+		if (ret) {
+			ubbd_dev_debug(ubbd_q->ubbd_dev, "xa_store failed.");
+			__ubbd_release_page(ubbd_q, page);
+			return ret;
+		}
 	}
 
 	if (bio->bi_next) {
@@ -163,20 +267,269 @@ again:
 		goto next_bio;
 	}
 
-out:
-	if (new_page) {
-		__ubbd_release_page(ubbd_q, new_page);
+	return 0;
+}
+
+/* drop at most this many slots per unmap pass */
+#define UBBD_SHRINK_BATCH	64
+
+/* in the slots[] of ubbd_queue_drop_slots(), the page isn't ours to free */
+#define UBBD_DROP_SLOT_KEEP_PAGE	(1U << 31)
+
+/*
+ * Unmap and erase the pages of data slots nobody else can use right now.
+ * One unmap per run of adjacent slots, slots[] must be sorted. Called
+ * with pages_mutex held.
+ */
+static void ubbd_queue_unmap_slots(struct ubbd_queue *ubbd_q, u32 *slots, int nr)
+{
+	struct page *page;
+	u32 slot;
+	int i, start = 0;
+
+	for (i = 1; i <= nr; i++) {
+		if (i < nr && (slots[i] & ~UBBD_DROP_SLOT_KEEP_PAGE) ==
+				(slots[i - 1] & ~UBBD_DROP_SLOT_KEEP_PAGE) + 1)
+			continue;
+
+		slot = slots[start] & ~UBBD_DROP_SLOT_KEEP_PAGE;
+		ubbd_kring_unmap_range(ubbd_q,
+				ubbd_q->data_off + (loff_t)slot * PAGE_SIZE,
+				(loff_t)(i - start) * PAGE_SIZE, 1);
+		start = i;
+	}
+
+	for (i = 0; i < nr; i++) {
+		slot = slots[i] & ~UBBD_DROP_SLOT_KEEP_PAGE;
+		page = xa_erase(&ubbd_q->data_pages_array, slot);
+		if (page && !(slots[i] & UBBD_DROP_SLOT_KEEP_PAGE))
+			__ubbd_release_page(ubbd_q, page);
 	}
+}
 
+/* unmap the pages of data slots we own, then give the slots back */
+static void ubbd_queue_drop_slots(struct ubbd_queue *ubbd_q, u32 *slots, int nr)
+{
+	int i;
 
-	if (ret) {
-		ubbd_dev_debug(ubbd_q->ubbd_dev, "ret is %d, bvec_index: %d", ret, bvec_index);
-		while (bvec_index > 0) {
-			ubbd_release_page(ubbd_q, req, --bvec_index);
+	ubbd_queue_unmap_slots(ubbd_q, slots, nr);
+	for (i = 0; i < nr; i++)
+		sbitmap_queue_clear(&ubbd_q->data_sbq, slots[i] & ~UBBD_DROP_SLOT_KEEP_PAGE,
+				raw_smp_processor_id());
+}
+
+static int ubbd_drop_slot_cmp(const void *a, const void *b)
+{
+	u32 x = *(const u32 *)a & ~UBBD_DROP_SLOT_KEEP_PAGE;
+	u32 y = *(const u32 *)b & ~UBBD_DROP_SLOT_KEEP_PAGE;
+
+	return (x > y) - (x < y);
+}
+
+static void ubbd_queue_drop_slots_sort(struct ubbd_queue *ubbd_q, u32 *slots, int nr)
+{
+	sort(slots, nr, sizeof(u32), ubbd_drop_slot_cmp, NULL);
+	ubbd_queue_drop_slots(ubbd_q, slots, nr);
+}
+
+/* slots of a completion sweep collected per unmap pass */
+#define UBBD_COMPLETE_UNMAP_BATCH	64
+
+/*
+ * Zerocopy: drop the data slots of all requests of a completion sweep
+ * under one pages_mutex hold, see ubbd_release_page() for single ones.
+ */
+static void ubbd_queue_release_zc(struct ubbd_queue *ubbd_q, struct list_head *done_list)
+{
+	u32 slots[UBBD_COMPLETE_UNMAP_BATCH];
+	struct ubbd_request *ubbd_req;
+	u32 keep_page;
+	int nr = 0;
+	u32 i;
+
+	mutex_lock(&ubbd_q->pages_mutex);
+	list_for_each_entry(ubbd_req, done_list, complete_node) {
+		if (!test_and_clear_bit(UBBD_REQ_FLAGS_DATA_SLOTS, &ubbd_req->flags))
+			continue;
+
+		keep_page = test_bit(UBBD_REQ_FLAGS_ZEROCOPY, &ubbd_req->flags) ?
+			UBBD_DROP_SLOT_KEEP_PAGE : 0;
+		for (i = 0; i < ubbd_req->pi_cnt; i++) {
+			slots[nr++] = ubbd_req_get_pi(ubbd_req, i) | keep_page;
+			if (nr == UBBD_COMPLETE_UNMAP_BATCH) {
+				ubbd_queue_drop_slots_sort(ubbd_q, slots, nr);
+				nr = 0;
+			}
 		}
 	}
+	ubbd_queue_drop_slots_sort(ubbd_q, slots, nr);
+	mutex_unlock(&ubbd_q->pages_mutex);
+}
 
-	return ret;
+static long ubbd_queue_shrink_count(struct ubbd_queue *ubbd_q)
+{
+	return (long)atomic_read(&ubbd_q->data_pages_allocated) - ubbd_q->data_pages_reserved;
+}
+
+/*
+ * Take a free slot away from submitters without allocating it from the
+ * sbitmap, which can't hand out a given slot: mark it in data_reclaim,
+ * then make sure no submitter got it meanwhile. One that gets it later
+ * sees the mark and backs off, see ubbd_get_data_slots().
+ */
+static bool ubbd_data_slot_claim(struct ubbd_queue *ubbd_q, u32 slot)
+{
+	struct sbitmap *sb = &ubbd_q->data_sbq.sb;
+
+	if (sbitmap_test_bit(sb, slot))
+		return false;
+
+	set_bit(slot, ubbd_q->data_reclaim);
+	smp_mb__after_atomic();
+	if (!sbitmap_test_bit(sb, slot))
+		return true;
+
+	clear_bit(slot, ubbd_q->data_reclaim);
+	return false;
+}
+
+/*
+ * Clock over the cached pages, starting where the last pass stopped. A
+ * slot used since the last pass gets a second chance, an idle one is
+ * claimed so no request can pick it up while its page goes away. Never
+ * goes below data_pages_reserved.
+ */
+static unsigned long ubbd_queue_shrink(struct ubbd_queue *ubbd_q, unsigned long nr_to_scan)
+{
+	XA_STATE(xas, &ubbd_q->data_pages_array, ubbd_q->shrink_hand);
+	u32 slots[UBBD_SHRINK_BATCH];
+	unsigned long scanned = 0;
+	struct page *page;
+	long nr_max;
+	int nr = 0;
+	int i;
+
+	if (!mutex_trylock(&ubbd_q->pages_mutex))
+		return 0;
+
+	nr_max = min_t(long, ubbd_queue_shrink_count(ubbd_q), UBBD_SHRINK_BATCH);
+	if (nr_max <= 0)
+		goto unlock;
+
+	rcu_read_lock();
+	xas_for_each(&xas, page, ubbd_q->data_pages - 1) {
+		if (xas_retry(&xas, page))
+			continue;
+
+		if (nr >= nr_max || scanned++ >= nr_to_scan)
+			break;
+
+		if (test_and_clear_bit(xas.xa_index, ubbd_q->data_ref))
+			continue;
+
+		if (ubbd_data_slot_claim(ubbd_q, xas.xa_index))
+			slots[nr++] = xas.xa_index;
+	}
+	/* start over from the first slot once we reached the end */
+	ubbd_q->shrink_hand = page ? xas.xa_index : 0;
+	rcu_read_unlock();
+
+	ubbd_queue_unmap_slots(ubbd_q, slots, nr);
+	for (i = 0; i < nr; i++)
+		clear_bit_unlock(slots[i], ubbd_q->data_reclaim);
+	atomic64_add(nr, &ubbd_q->data_pages_reclaimed);
+unlock:
+	mutex_unlock(&ubbd_q->pages_mutex);
+
+	/* a submitter may have backed off from a slot we tried to claim */
+	if (scanned)
+		ubbd_queue_restart(ubbd_q);
+
+	return nr;
+}
+
+static unsigned long ubbd_dev_shrink_count(struct shrinker *shrinker,
+		struct shrink_control *sc)
+{
+	struct ubbd_device *ubbd_dev = ubbd_shrinker_to_dev(shrinker);
+	unsigned long count = 0;
+	long nr;
+	int i;
+
+	for (i = 0; i < ubbd_dev->num_queues; i++) {
+		nr = ubbd_queue_shrink_count(&ubbd_dev->queues[i]);
+		if (nr > 0)
+			count += nr;
+	}
+
+	return count;
+}
+
+static unsigned long ubbd_dev_shrink_scan(struct shrinker *shrinker,
+		struct shrink_control *sc)
+{
+	struct ubbd_device *ubbd_dev = ubbd_shrinker_to_dev(shrinker);
+	unsigned long nr_to_scan = DIV_ROUND_UP(sc->nr_to_scan, ubbd_dev->num_queues);
+	unsigned long freed = 0;
+	int i;
+
+	/* unmap_mapping_range() takes i_mmap_rwsem */
+	if (!(sc->gfp_mask & __GFP_FS))
+		return SHRINK_STOP;
+
+	for (i = 0; i < ubbd_dev->num_queues; i++)
+		freed += ubbd_queue_shrink(&ubbd_dev->queues[i], nr_to_scan);
+
+	return freed;
+}
+
+int ubbd_dev_shrinker_init(struct ubbd_device *ubbd_dev)
+{
+	struct shrinker *shrinker;
+
+#ifdef HAVE_SHRINKER_ALLOC
+	shrinker = shrinker_alloc(0, "ubbd%d", ubbd_dev->dev_id);
+	if (!shrinker)
+		return -ENOMEM;
+	shrinker->private_data = ubbd_dev;
+#else
+	shrinker = &ubbd_dev->data_shrinker;
+#endif /* HAVE_SHRINKER_ALLOC */
+	shrinker->count_objects = ubbd_dev_shrink_count;
+	shrinker->scan_objects = ubbd_dev_shrink_scan;
+	shrinker->seeks = DEFAULT_SEEKS;
+
+#ifdef HAVE_SHRINKER_ALLOC
+	shrinker_register(shrinker);
+#else
+	{
+		int ret;
+
+#ifdef HAVE_REGISTER_SHRINKER_NAME
+		ret = register_shrinker(shrinker, "ubbd%d", ubbd_dev->dev_id);
+#else
+		ret = register_shrinker(shrinker);
+#endif /* HAVE_REGISTER_SHRINKER_NAME */
+		if (ret)
+			return ret;
+	}
+#endif /* HAVE_SHRINKER_ALLOC */
+	ubbd_dev->shrinker = shrinker;
+
+	return 0;
+}
+
+void ubbd_dev_shrinker_exit(struct ubbd_device *ubbd_dev)
+{
+	if (!ubbd_dev->shrinker)
+		return;
+
+#ifdef HAVE_SHRINKER_ALLOC
+	shrinker_free(ubbd_dev->shrinker);
+#else
+	unregister_shrinker(ubbd_dev->shrinker);
+#endif /* HAVE_SHRINKER_ALLOC */
+	ubbd_dev->shrinker = NULL;
 }
 
 static void ubbd_set_se_iov(struct ubbd_request *ubbd_req)
@@ -205,6 +558,56 @@ next:
 	return;
 }
 
+/*
+ * UBBD_SB_F_COMPACT_SE: describe the data of the request as extents,
+ * merging a bvec into the previous extent when it starts at offset 0 of
+ * the data page right after a bvec that ended at the page end. Returns
+ * the number of extents, and only counts them when ext is NULL.
+ */
+static uint32_t ubbd_set_se_extents(struct ubbd_request *ubbd_req,
+		struct ubbd_se_extent *ext)
+{
+	uint32_t bvec_index = 0;
+	uint32_t ext_cnt = 0;
+	struct bio_vec bv;
+	struct bvec_iter iter;
+	struct bio *bio = ubbd_req->req->bio;
+	struct ubbd_se_extent cur = { 0 };
+	uint32_t page_index, last_index = 0, last_end = 0;
+
+next:
+	bio_for_each_segment(bv, bio, iter) {
+		page_index = ubbd_req_get_pi(ubbd_req, bvec_index);
+
+		if (ext_cnt && page_index == last_index + 1 &&
+				last_end == PAGE_SIZE && !bv.bv_offset &&
+				cur.len + bv.bv_len <= U16_MAX) {
+			cur.len += bv.bv_len;
+		} else {
+			if (ext_cnt && ext)
+				ext[ext_cnt - 1] = cur;
+			cur.page_index = page_index;
+			cur.offset = bv.bv_offset;
+			cur.len = bv.bv_len;
+			ext_cnt++;
+		}
+
+		last_index = page_index;
+		last_end = bv.bv_offset + bv.bv_len;
+		bvec_index++;
+	}
+
+	if (bio->bi_next) {
+		bio = bio->bi_next;
+		goto next;
+	}
+
+	if (ext_cnt && ext)
+		ext[ext_cnt - 1] = cur;
+
+	return ext_cnt;
+}
+
 static struct page *ubbd_req_get_page(struct ubbd_request *req, uint32_t bvec_index)
 {
 	struct ubbd_queue *ubbd_q = req->ubbd_q;
@@ -243,6 +646,37 @@ static uint32_t ubbd_req_segments(struct ubbd_request *ubbd_req)
 	return segs;
 }
 
+static bool ubbd_req_can_zerocopy(struct ubbd_request *ubbd_req)
+{
+	struct bio_vec bv;
+	struct bvec_iter iter;
+	struct bio *bio = ubbd_req->req->bio;
+
+	if (!ubbd_dev_zerocopy(ubbd_req->ubbd_q->ubbd_dev))
+		return false;
+
+next:
+	bio_for_each_segment(bv, bio, iter) {
+		/*
+		 * Anonymous, slab and zero pages can't be inserted into the
+		 * backend's mapping, such requests go through bounce pages.
+		 * That includes O_DIRECT IO from anonymous user buffers (fio
+		 * direct=1 with its default buffers): zerocopy only saves the
+		 * memcpy for buffered IO, whose bios carry page cache pages.
+		 */
+		if (PageAnon(bv.bv_page) || PageSlab(bv.bv_page) ||
+				is_zero_pfn(page_to_pfn(bv.bv_page)))
+			return false;
+	}
+
+	if (bio->bi_next) {
+		bio = bio->bi_next;
+		goto next;
+	}
+
+	return true;
+}
+
 static void copy_data_from_ubbdreq(struct ubbd_request *ubbd_req)
 {
 	uint32_t bvec_index = 0;
@@ -306,6 +740,35 @@ copy:
 	return;
 }
 
+/* copy between the bio and the data inline in the SE */
+static void copy_inline_data(struct ubbd_request *ubbd_req, bool to_se)
+{
+	struct bio_vec bv;
+	struct bvec_iter iter;
+	void *data = ubbd_req->se->iov;
+	void *page_addr;
+	struct bio *bio = ubbd_req->req->bio;
+
+	if (!to_se)
+		ubbd_flush_dcache_range(data, blk_rq_bytes(ubbd_req->req));
+copy:
+	bio_for_each_segment(bv, bio, iter) {
+		page_addr = kmap_atomic(bv.bv_page);
+		if (to_se)
+			memcpy(data, page_addr + bv.bv_offset, bv.bv_len);
+		else
+			memcpy(page_addr + bv.bv_offset, data, bv.bv_len);
+		kunmap_atomic(page_addr);
+
+		data += bv.bv_len;
+	}
+
+	if (bio->bi_next) {
+		bio = bio->bi_next;
+		goto copy;
+	}
+}
+
 static bool submit_ring_space_enough(struct ubbd_queue *ubbd_q, u32 cmd_size)
 {
 	u32 space_available;
@@ -315,19 +778,19 @@ static bool submit_ring_space_enough(struct ubbd_queue *ubbd_q, u32 cmd_size)
 	/* There is a CMDR_RESERVED we dont use to prevent the ring to be used up */
 	space_max = ubbd_q->sb_addr->cmdr_size - CMDR_RESERVED;
 
-	if (ubbd_q->sb_addr->cmd_head > ubbd_q->sb_addr->cmd_tail)
-		space_used = ubbd_q->sb_addr->cmd_head - ubbd_q->sb_addr->cmd_tail;
-	else if (ubbd_q->sb_addr->cmd_head < ubbd_q->sb_addr->cmd_tail)
-		space_used = ubbd_q->sb_addr->cmd_head + (ubbd_q->sb_addr->cmdr_size - ubbd_q->sb_addr->cmd_tail);
+	if (ubbd_q->cmd_head > *ubbd_q->sb_cmd_tail)
+		space_used = ubbd_q->cmd_head - *ubbd_q->sb_cmd_tail;
+	else if (ubbd_q->cmd_head < *ubbd_q->sb_cmd_tail)
+		space_used = ubbd_q->cmd_head + (ubbd_q->sb_addr->cmdr_size - *ubbd_q->sb_cmd_tail);
 	else
 		space_used = 0;
 
 	space_available = space_max - space_used;
 
-	if (ubbd_q->sb_addr->cmdr_size - ubbd_q->sb_addr->cmd_head > cmd_size)
+	if (ubbd_q->sb_addr->cmdr_size - ubbd_q->cmd_head > cmd_size)
 		space_needed = cmd_size;
 	else
-		space_needed = cmd_size + ubbd_q->sb_addr->cmdr_size - ubbd_q->sb_addr->cmd_head;
+		space_needed = cmd_size + ubbd_q->sb_addr->cmdr_size - ubbd_q->cmd_head;
 
 	if (space_available < space_needed)
 		return false;
@@ -340,17 +803,17 @@ static void insert_padding(struct ubbd_queue *ubbd_q, u32 cmd_size)
 	struct ubbd_se_hdr *header;
 	u32 pad_len;
 
-	if (ubbd_q->sb_addr->cmdr_size - ubbd_q->sb_addr->cmd_head >= cmd_size)
+	if (ubbd_q->sb_addr->cmdr_size - ubbd_q->cmd_head >= cmd_size)
 		return;
 
-	pad_len = ubbd_q->sb_addr->cmdr_size - ubbd_q->sb_addr->cmd_head;
+	pad_len = ubbd_q->sb_addr->cmdr_size - ubbd_q->cmd_head;
 
 	header = (struct ubbd_se_hdr *)get_submit_entry(ubbd_q);
 	memset(header, 0, pad_len);
 	ubbd_se_hdr_set_op(&header->len_op, UBBD_OP_PAD);
 	ubbd_se_hdr_set_len(&header->len_op, pad_len);
 
-	UPDATE_CMDR_HEAD(ubbd_q->sb_addr->cmd_head, pad_len, ubbd_q->sb_addr->cmdr_size);
+	UPDATE_CMDR_HEAD(ubbd_q->cmd_head, pad_len, ubbd_q->sb_addr->cmdr_size);
 }
 
 static void ubbd_req_init(struct ubbd_queue *ubbd_q, enum ubbd_op op, struct request *rq)
@@ -362,12 +825,12 @@ static void ubbd_req_init(struct ubbd_queue *ubbd_q, enum ubbd_op op, struct req
 	ubbd_req->op = op;
 }
 
-static int ubbd_req_pi_alloc(struct ubbd_request *ubbd_req)
+static int ubbd_req_pi_alloc(struct ubbd_request *ubbd_req, gfp_t gfp)
 {
 	if (ubbd_req_need_fault())
 		return -ENOMEM;
-	ubbd_req->pi = kcalloc(ubbd_req->pi_cnt - UBBD_REQ_INLINE_PI_MAX,
-				sizeof(uint32_t), GFP_NOIO);
+	ubbd_req->pi = kcalloc_node(ubbd_req->pi_cnt - UBBD_REQ_INLINE_PI_MAX,
+				sizeof(uint32_t), gfp, ubbd_req->ubbd_q->numa_node);
 	if (!ubbd_req->pi)
 		return -ENOMEM;
 
@@ -376,20 +839,42 @@ static int ubbd_req_pi_alloc(struct ubbd_request *ubbd_req)
 
 static inline size_t ubbd_get_cmd_size(struct ubbd_request *ubbd_req)
 {
-	u32 cmd_size = sizeof(struct ubbd_se) + (sizeof(struct iovec) * ubbd_req->pi_cnt);
+	u32 cmd_size = sizeof(struct ubbd_se) +
+		(ubbd_queue_iov_size(ubbd_req->ubbd_q) * ubbd_req->iov_cnt);
+
+	if (test_bit(UBBD_REQ_FLAGS_INLINE_DATA, &ubbd_req->flags))
+		cmd_size += blk_rq_bytes(ubbd_req->req);
 
 	return round_up(cmd_size, UBBD_OP_ALIGN_SIZE);
 }
 
-static int queue_req_prepare(struct ubbd_request *ubbd_req)
+/* small reads and writes skip the data area */
+static bool ubbd_req_inline_data(struct ubbd_request *ubbd_req)
+{
+	struct ubbd_device *ubbd_dev = ubbd_req->ubbd_q->ubbd_dev;
+
+	if (ubbd_req_nodata(ubbd_req))
+		return false;
+
+	return (blk_rq_bytes(ubbd_req->req) <= ubbd_dev->inline_data_max);
+}
+
+static int queue_req_prepare(struct ubbd_request *ubbd_req, gfp_t gfp)
 {
 	struct ubbd_queue *ubbd_q = ubbd_req->ubbd_q;
 	int ret;
 
+	if (ubbd_req_inline_data(ubbd_req)) {
+		set_bit(UBBD_REQ_FLAGS_INLINE_DATA, &ubbd_req->flags);
+		ubbd_req->pi_cnt = 0;
+		ubbd_req->iov_cnt = 0;
+		return 0;
+	}
+
 	ubbd_req->pi_cnt = ubbd_req_segments(ubbd_req);
 
 	if (ubbd_req->pi_cnt > UBBD_REQ_INLINE_PI_MAX) {
-		ret = ubbd_req_pi_alloc(ubbd_req);
+		ret = ubbd_req_pi_alloc(ubbd_req, gfp);
 		if (ret) {
 			ubbd_dev_err(ubbd_q->ubbd_dev, "pi kcalloc failed");
 			goto err;
@@ -398,22 +883,28 @@ static int queue_req_prepare(struct ubbd_request *ubbd_req)
 	}
 
 	if (ubbd_req->pi_cnt) {
-		ret = ubbd_get_data_pages(ubbd_q, ubbd_req);
+		if (ubbd_req_can_zerocopy(ubbd_req))
+			set_bit(UBBD_REQ_FLAGS_ZEROCOPY, &ubbd_req->flags);
+
+		ret = ubbd_get_data_pages(ubbd_q, ubbd_req, gfp);
 		if (ret) {
 			ubbd_dev_debug(ubbd_q->ubbd_dev, "get data page failed");
-			goto err_free_pi;
+			goto err;
 		}
 	}
 
-	if (req_op(ubbd_req->req) == REQ_OP_WRITE) {
+	if (ubbd_req->pi_cnt && ubbd_dev_compact_se(ubbd_q->ubbd_dev))
+		ubbd_req->iov_cnt = ubbd_set_se_extents(ubbd_req, NULL);
+	else
+		ubbd_req->iov_cnt = ubbd_req->pi_cnt;
+
+	if (req_op(ubbd_req->req) == REQ_OP_WRITE &&
+			!test_bit(UBBD_REQ_FLAGS_ZEROCOPY, &ubbd_req->flags)) {
 		copy_data_to_ubbdreq(ubbd_req);
 	}
 
 	return 0;
 
-err_free_pi:
-	if (ubbd_req->pi)
-		kfree(ubbd_req->pi);
 err:
 	return ret;
 
@@ -426,32 +917,190 @@ static void queue_req_se_init(struct ubbd_request *ubbd_req)
 	u64 offset = (u64)blk_rq_pos(ubbd_req->req) << SECTOR_SHIFT;
 	u64 length = blk_rq_bytes(ubbd_req->req);
 
-	se = get_submit_entry(ubbd_req->ubbd_q);
+	se = ubbd_req->se;
 	memset(se, 0, ubbd_get_cmd_size(ubbd_req));
 	header = &se->header;
 
 	ubbd_se_hdr_set_op(&header->len_op, ubbd_req->op);
 	ubbd_se_hdr_set_len(&header->len_op, ubbd_get_cmd_size(ubbd_req));
 
-	se->priv_data = ubbd_req->req_tid;
+	se->priv_data = atomic64_read(&ubbd_req->req_tid);
 	se->offset = offset;
 	se->len = length;
-	se->iov_cnt = ubbd_req->pi_cnt;
+	se->iov_cnt = ubbd_req->iov_cnt;
 
-	ubbd_req->se = se;
+	if (test_bit(UBBD_REQ_FLAGS_INLINE_DATA, &ubbd_req->flags))
+		ubbd_se_hdr_flags_set(se, UBBD_SE_HDR_INLINE_DATA);
 }
 
 static void queue_req_data_init(struct ubbd_request *ubbd_req)
 {
-	if (ubbd_req->pi_cnt) {
+	if (test_bit(UBBD_REQ_FLAGS_INLINE_DATA, &ubbd_req->flags)) {
+		if (req_op(ubbd_req->req) == REQ_OP_WRITE)
+			copy_inline_data(ubbd_req, true);
+		return;
+	}
+
+	if (!ubbd_req->pi_cnt)
+		return;
+
+	if (ubbd_dev_compact_se(ubbd_req->ubbd_q->ubbd_dev))
+		ubbd_set_se_extents(ubbd_req, (struct ubbd_se_extent *)ubbd_req->se->iov);
+	else
 		ubbd_set_se_iov(ubbd_req);
+}
+
+static void ubbd_req_release(struct ubbd_request *ubbd_req)
+{
+	uint32_t bvec_index = 0;
+	struct ubbd_queue *ubbd_q = ubbd_req->ubbd_q;
+
+	if (test_and_clear_bit(UBBD_REQ_FLAGS_DATA_SLOTS, &ubbd_req->flags)) {
+		for (bvec_index = 0; bvec_index < ubbd_req->pi_cnt; bvec_index++) {
+			ubbd_release_page(ubbd_q, ubbd_req, bvec_index);
+		}
+		ubbd_queue_restart(ubbd_q);
+	}
+
+	if (ubbd_req->pi) {
+		kfree(ubbd_req->pi);
+		ubbd_req->pi = NULL;
 	}
 }
 
-static void ubbd_queue_workfn(struct work_struct *work)
+static void ubbd_req_set_tid(struct ubbd_queue *ubbd_q, struct ubbd_request *ubbd_req)
+{
+	struct request *req = ubbd_req->req;
+
+	/* generation 0 is never used, so req_tid 0 means not inflight */
+	if (unlikely(!++ubbd_q->req_gen))
+		ubbd_q->req_gen++;
+
+	atomic64_set(&ubbd_req->req_tid,
+			UBBD_REQ_TID(ubbd_q->req_gen, req->mq_hctx->queue_num, req->tag));
+}
+
+/*
+ * Whether the backend wants a notify for the SEs in [old, new) of the cmd
+ * ring, as asked for in the bflags of the shared sb_ext.
+ */
+static bool ubbd_queue_need_notify(struct ubbd_queue *ubbd_q, u32 old, u32 new)
+{
+	struct ubbd_sb_ext *sb_ext = ubbd_q->sb_ext;
+	u32 size = ubbd_q->sb_addr->cmdr_size;
+	u32 bflags, event;
+
+	/* pairs with the barrier between bflags/cmd_event and cmd_head in the backend */
+	smp_mb();
+
+	bflags = READ_ONCE(sb_ext->bflags);
+	if (bflags & UBBD_SB_EXT_BF_POLLING)
+		return false;
+
+	if (!(bflags & UBBD_SB_EXT_BF_CMD_EVENT))
+		return true;
+
+	/* vring_need_event() on byte offsets, with the ring size as modulus */
+	event = READ_ONCE(sb_ext->cmd_event);
+
+	return ((new - event - 1 + size) % size < (new - old + size) % size);
+}
+
+/*
+ * Publish the SEs queued since the last commit to the backend, with a
+ * single cmd_head update and a single notify for the whole batch.
+ */
+void ubbd_queue_commit(struct ubbd_queue *ubbd_q)
+{
+	bool notify = false;
+	u32 old, new;
+
+	spin_lock(&ubbd_q->cmdr_lock);
+	old = *ubbd_q->sb_cmd_head;
+	new = ubbd_q->cmd_head;
+	if (old != new) {
+		smp_store_release(ubbd_q->sb_cmd_head, new);
+		notify = ubbd_queue_need_notify(ubbd_q, old, new);
+		if (notify)
+			ubbd_q->notify_delivered++;
+		else
+			ubbd_q->notify_suppressed++;
+	}
+	spin_unlock(&ubbd_q->cmdr_lock);
+
+	if (old == new)
+		return;
+
+	if (ubbd_q->ubbd_dev->complete_ctx == UBBD_COMPLETE_CTX_SUBMIT_CPU)
+		WRITE_ONCE(ubbd_q->submit_cpu, raw_smp_processor_id());
+
+	ubbd_queue_flush_sb(ubbd_q);
+
+#ifdef HAVE_URING_CMD
+	/* pairs with smp_mb() in ubbd_queue_fetch() */
+	smp_mb();
+	if (!list_empty(&ubbd_q->fetch_cmds))
+		ubbd_queue_complete_fetch(ubbd_q, new);
+#endif /* HAVE_URING_CMD */
+
+	/* pairs with the barrier in wait_event() */
+	if (wq_has_sleeper(&ubbd_q->cmd_wait))
+		wake_up_interruptible(&ubbd_q->cmd_wait);
+
+	if (notify)
+		ubbd_queue_notify(ubbd_q);
+}
+
+/*
+ * UBBD_SB_F_SLOT_RING: the SE goes into a free slot, the cmd ring only
+ * carries its index. The slot is freed in ubbd_req_complete_prep().
+ */
+static int ubbd_queue_submit_slot(struct ubbd_request *ubbd_req)
+{
+	struct ubbd_queue *ubbd_q = ubbd_req->ubbd_q;
+	int slot;
+
+	if (unlikely(ubbd_req->pi_cnt > UBBD_SLOT_IOV_MAX)) {
+		ubbd_queue_err(ubbd_q, "too many segments for a slot: %u", ubbd_req->pi_cnt);
+		return -EIO;
+	}
+
+	slot = __sbitmap_queue_get(&ubbd_q->cmd_slots);
+	if (slot < 0) {
+		ubbd_dev_debug(ubbd_q->ubbd_dev, "no free cmd slot");
+		atomic64_inc(&ubbd_q->cmdr_full);
+		return -ENOSPC;
+	}
+
+	ubbd_req->slot = slot;
+	ubbd_req->se = ubbd_q->slots + (size_t)slot * ubbd_q->slot_size;
+
+	spin_lock(&ubbd_q->cmdr_lock);
+	ubbd_req_set_tid(ubbd_q, ubbd_req);
+	atomic_inc(&ubbd_q->inflight);
+
+	queue_req_se_init(ubbd_req);
+	queue_req_data_init(ubbd_req);
+
+#ifdef UBBD_REQUEST_STATS
+	ubbd_req_stats_ktime_delta(ubbd_req->start_to_submit, ubbd_req->start_kt);
+#endif
+
+	*(u32 *)(ubbd_q->cmdr + ubbd_q->cmd_head) = slot;
+	UPDATE_CMDR_HEAD(ubbd_q->cmd_head, sizeof(u32), ubbd_q->sb_addr->cmdr_size);
+	spin_unlock(&ubbd_q->cmdr_lock);
+
+	return 0;
+}
+
+/*
+ * Prepare a request and queue its SE in the cmd ring, the backend sees it
+ * after the next ubbd_queue_commit(). This runs inline from
+ * ubbd_queue_rq() with a non-sleeping gfp, and from task_wq with
+ * GFP_NOIO when the inline attempt ran out of resources.
+ */
+static int ubbd_queue_submit(struct ubbd_request *ubbd_req, gfp_t gfp)
 {
-	struct ubbd_request *ubbd_req =
-		container_of(work, struct ubbd_request, work);
 	struct ubbd_queue *ubbd_q = ubbd_req->ubbd_q;
 	int ret = 0;
 	int status = atomic_read(&ubbd_q->status);
@@ -463,43 +1112,39 @@ static void ubbd_queue_workfn(struct work_struct *work)
 		 * in force unmapping.
 		 * */
 		if (status == UBBD_QUEUE_KSTATUS_REMOVING) {
-			ret = -EIO;
-			goto end_request;
+			return -EIO;
 		} else if (status == UBBD_QUEUE_KSTATUS_STOPPING ||
 				status == UBBD_QUEUE_KSTATUS_STOPPED) {
-			ret = -EBUSY;
-			goto end_request;
+			return -EBUSY;
 		}
 	}
 
+	/* see ubbd_req_wait_res() */
+	ubbd_req->res_seq = atomic_read_acquire(&ubbd_q->res_seq);
+
 	ubbd_req_stats_ktime_delta(ubbd_req->start_to_prepare, ubbd_req->start_kt);
-	ret = queue_req_prepare(ubbd_req);
+	ret = queue_req_prepare(ubbd_req, gfp);
 	if (ret) {
-		goto end_request;
+		return ret;
 	}
 
-	spin_lock(&ubbd_q->inflight_reqs_lock);
-	list_add_tail(&ubbd_req->inflight_reqs_node, &ubbd_q->inflight_reqs);
-	spin_unlock(&ubbd_q->inflight_reqs_lock);
+	if (ubbd_q->slots)
+		return ubbd_queue_submit_slot(ubbd_req);
 
 	command_size = ubbd_get_cmd_size(ubbd_req);
 
 	spin_lock(&ubbd_q->cmdr_lock);
 	if (!submit_ring_space_enough(ubbd_q, command_size)) {
 		spin_unlock(&ubbd_q->cmdr_lock);
-
-		/* remove request from inflight_reqs */
-		spin_lock(&ubbd_q->inflight_reqs_lock);
-		list_del_init(&ubbd_req->inflight_reqs_node);
-		spin_unlock(&ubbd_q->inflight_reqs_lock);
-
 		ubbd_dev_debug(ubbd_q->ubbd_dev, "cmd ring space is not enough");
-		ret = -ENOMEM;
-		goto end_request;
+		atomic64_inc(&ubbd_q->cmdr_full);
+		return -ENOSPC;
 	}
 
 	insert_padding(ubbd_q, command_size);
-	ubbd_req->req_tid = ++ubbd_q->req_tid;
+	ubbd_req->se = get_submit_entry(ubbd_q);
+	ubbd_req_set_tid(ubbd_q, ubbd_req);
+	atomic_inc(&ubbd_q->inflight);
 
 	queue_req_se_init(ubbd_req);
 	queue_req_data_init(ubbd_req);
@@ -509,33 +1154,75 @@ static void ubbd_queue_workfn(struct work_struct *work)
 	ubbd_req_stats_ktime_delta(ubbd_req->start_to_submit, ubbd_req->start_kt);
 #endif
 
-	UPDATE_CMDR_HEAD(ubbd_q->sb_addr->cmd_head,
+	UPDATE_CMDR_HEAD(ubbd_q->cmd_head,
 			ubbd_get_cmd_size(ubbd_req),
 			ubbd_q->sb_addr->cmdr_size);
 	spin_unlock(&ubbd_q->cmdr_lock);
 
-	ubbd_flush_dcache_range(ubbd_q->sb_addr, sizeof(*ubbd_q->sb_addr));
+	return 0;
+}
 
-	ubbd_kring_event_notify(&ubbd_q->ubbd_kring_info);
+/*
+ * The cmd ring or the data area of the queue is full. Park the request on
+ * the requeue list and stop its hctx until a completion makes room,
+ * instead of dispatching it again right away. REQ_NOWAIT IO fails with
+ * BLK_STS_AGAIN.
+ */
+static void ubbd_req_wait_res(struct ubbd_request *ubbd_req)
+{
+	struct ubbd_queue *ubbd_q = ubbd_req->ubbd_q;
+	struct request *req = ubbd_req->req;
 
-	return;
+	if (req->cmd_flags & REQ_NOWAIT) {
+		blk_mq_end_request(req, BLK_STS_AGAIN);
+		return;
+	}
+
+	blk_mq_stop_hw_queue(req->mq_hctx);
+	set_bit(UBBD_QUEUE_FLAGS_WAIT_RES, &ubbd_q->flags);
+	atomic64_inc(&ubbd_q->res_stops);
+	blk_mq_requeue_request(req, false);
+
+	/*
+	 * Room freed after our submit attempt, but before we set the flag,
+	 * didn't restart us. Whoever freed it bumped res_seq.
+	 */
+	smp_mb__after_atomic();
+	if (atomic_read(&ubbd_q->res_seq) != ubbd_req->res_seq)
+		ubbd_queue_restart(ubbd_q);
+}
+
+static void ubbd_queue_workfn(struct work_struct *work)
+{
+	struct ubbd_request *ubbd_req =
+		container_of(work, struct ubbd_request, work);
+	int ret;
+
+	/* drop whatever the inline attempt left behind before retrying */
+	ubbd_req_release(ubbd_req);
 
-end_request:
-	if (ret == -ENOMEM || ret == -EBUSY)
+	ret = ubbd_queue_submit(ubbd_req, GFP_NOIO);
+	if (!ret) {
+		ubbd_queue_commit(ubbd_req->ubbd_q);
+		return;
+	}
+
+	ubbd_req_release(ubbd_req);
+
+	if (ret == -ENOSPC)
+		ubbd_req_wait_res(ubbd_req);
+	else if (ret == -ENOMEM || ret == -EBUSY)
 		blk_mq_requeue_request(ubbd_req->req, true);
 	else
 		blk_mq_end_request(ubbd_req->req, errno_to_blk_status(ret));
-
-	return;
 }
 
-blk_status_t ubbd_queue_rq(struct blk_mq_hw_ctx *hctx,
-		const struct blk_mq_queue_data *bd)
+static blk_status_t __ubbd_queue_rq(struct ubbd_queue *ubbd_q, struct request *req)
 {
-	struct ubbd_queue *ubbd_q = hctx->driver_data;
-	struct request *req = bd->rq;
-	struct ubbd_request *ubbd_req = blk_mq_rq_to_pdu(bd->rq);
+	struct ubbd_request *ubbd_req = blk_mq_rq_to_pdu(req);
 	int status = atomic_read(&ubbd_q->status);
+	enum ubbd_op op;
+	int ret;
 
 	if (unlikely(status != UBBD_QUEUE_KSTATUS_RUNNING)) {
 		/*
@@ -550,93 +1237,177 @@ blk_status_t ubbd_queue_rq(struct blk_mq_hw_ctx *hctx,
 		}
 	}
 
-	memset(ubbd_req, 0, sizeof(struct ubbd_request));
-	INIT_LIST_HEAD(&ubbd_req->inflight_reqs_node);
-
-	ubbd_req_stats_ktime_get(ubbd_req->start_kt);
-
-	blk_mq_start_request(bd->rq);
-
-	switch (req_op(bd->rq)) {
+	switch (req_op(req)) {
 	case REQ_OP_FLUSH:
-		ubbd_req_init(ubbd_q, UBBD_OP_FLUSH, req);
+		op = UBBD_OP_FLUSH;
 		break;
 	case REQ_OP_DISCARD:
-		ubbd_req_init(ubbd_q, UBBD_OP_DISCARD, req);
+		op = UBBD_OP_DISCARD;
 		break;
 	case REQ_OP_WRITE_ZEROES:
-		ubbd_req_init(ubbd_q, UBBD_OP_WRITE_ZEROS, req);
+		op = UBBD_OP_WRITE_ZEROS;
 		break;
 	case REQ_OP_WRITE:
-		ubbd_req_init(ubbd_q, UBBD_OP_WRITE, req);
+		op = UBBD_OP_WRITE;
 		break;
 	case REQ_OP_READ:
-		ubbd_req_init(ubbd_q, UBBD_OP_READ, req);
+		op = UBBD_OP_READ;
 		break;
 	default:
 		return BLK_STS_IOERR;
 	}
 
+	memset(ubbd_req, 0, sizeof(struct ubbd_request));
+
+	ubbd_req_stats_ktime_get(ubbd_req->start_kt);
+
+	blk_mq_start_request(req);
+
+	ubbd_req_init(ubbd_q, op, req);
+
+	ret = ubbd_queue_submit(ubbd_req, GFP_NOWAIT | __GFP_NOWARN);
+	if (likely(!ret))
+		return BLK_STS_OK;
+
+	/* without data slots there is nothing to release that could sleep */
+	if (ret == -ENOSPC && !test_bit(UBBD_REQ_FLAGS_DATA_SLOTS, &ubbd_req->flags)) {
+		ubbd_req_release(ubbd_req);
+		ubbd_req_wait_res(ubbd_req);
+		return BLK_STS_OK;
+	}
+
+	/*
+	 * We can't sleep here, let task_wq release what we got so far and
+	 * retry with an allocation that can wait.
+	 */
 	INIT_WORK(&ubbd_req->work, ubbd_queue_workfn);
 	queue_work(ubbd_q->ubbd_dev->task_wq, &ubbd_req->work);
 
 	return BLK_STS_OK;
 }
 
-static void ubbd_req_release(struct ubbd_request *ubbd_req)
+blk_status_t ubbd_queue_rq(struct blk_mq_hw_ctx *hctx,
+		const struct blk_mq_queue_data *bd)
 {
-	uint32_t bvec_index = 0;
-	struct ubbd_queue *ubbd_q = ubbd_req->ubbd_q;
+	struct ubbd_queue *ubbd_q = hctx->driver_data;
+	blk_status_t ret;
 
-	for (bvec_index = 0; bvec_index < ubbd_req->pi_cnt; bvec_index++) {
-		ubbd_release_page(ubbd_q, ubbd_req, bvec_index);
-	}
+	ret = __ubbd_queue_rq(ubbd_q, bd->rq);
+#ifdef HAVE_COMMIT_RQS
+	/* blk-mq calls ubbd_commit_rqs() if the batch ends early */
+	if (!bd->last)
+		return ret;
+#endif /* HAVE_COMMIT_RQS */
+	ubbd_queue_commit(ubbd_q);
 
-	if (ubbd_req->pi) {
-		kfree(ubbd_req->pi);
-		ubbd_req->pi = NULL;
+	return ret;
+}
+
+#ifdef HAVE_COMMIT_RQS
+void ubbd_commit_rqs(struct blk_mq_hw_ctx *hctx)
+{
+	ubbd_queue_commit(hctx->driver_data);
+}
+#endif /* HAVE_COMMIT_RQS */
+
+#ifdef HAVE_QUEUE_RQS
+/*
+ * Queue a plug list, committing once per ubbd_queue. Requests we can't
+ * take are left in rqlist and blk-mq issues them through ubbd_queue_rq().
+ */
+#ifdef HAVE_RQ_LIST
+void ubbd_queue_rqs(struct rq_list *rqlist)
+{
+	struct rq_list requeue_list = {};
+#else
+void ubbd_queue_rqs(struct request **rqlist)
+{
+	struct request *requeue_list = NULL;
+#endif /* HAVE_RQ_LIST */
+	struct ubbd_queue *ubbd_q = NULL, *this_q;
+	struct request *req;
+
+	while ((req = rq_list_pop(rqlist))) {
+		this_q = req->mq_hctx->driver_data;
+		if (ubbd_q && ubbd_q != this_q)
+			ubbd_queue_commit(ubbd_q);
+		ubbd_q = this_q;
+
+		if (__ubbd_queue_rq(ubbd_q, req) != BLK_STS_OK) {
+#ifdef HAVE_RQ_LIST
+			rq_list_add_tail(&requeue_list, req);
+#else
+			rq_list_add(&requeue_list, req);
+#endif /* HAVE_RQ_LIST */
+		}
 	}
+
+	if (ubbd_q)
+		ubbd_queue_commit(ubbd_q);
+
+	*rqlist = requeue_list;
 }
+#endif /* HAVE_QUEUE_RQS */
 
 static void advance_cmd_ring(struct ubbd_queue *ubbd_q)
 {
        struct ubbd_se *se;
 
+	/* slots are freed one by one, there is no cmd_tail to move */
+	if (ubbd_q->slots)
+		return;
+
 again:
        se = get_oldest_se(ubbd_q);
        if (!se)
                goto out;
 
 	if (ubbd_se_hdr_flags_test(se, UBBD_SE_HDR_DONE)) {
-		UPDATE_CMDR_TAIL(ubbd_q->sb_addr->cmd_tail,
+		UPDATE_CMDR_TAIL(*ubbd_q->sb_cmd_tail,
 				ubbd_se_hdr_get_len(se->header.len_op),
 				ubbd_q->sb_addr->cmdr_size);
 		goto again;
        }
 out:
-       ubbd_flush_dcache_range(ubbd_q->sb_addr, sizeof(*ubbd_q->sb_addr));
+       ubbd_queue_flush_sb(ubbd_q);
        return;
 }
 
+static void ubbd_queue_inflight_dec(struct ubbd_queue *ubbd_q)
+{
+	if (atomic_dec_and_test(&ubbd_q->inflight))
+		atomic_cmpxchg(&ubbd_q->status, UBBD_QUEUE_KSTATUS_STOPPING,
+				UBBD_QUEUE_KSTATUS_STOPPED);
+}
+
 static struct ubbd_request *fetch_inflight_req(struct ubbd_queue *ubbd_q, u64 req_tid)
 {
-	struct ubbd_request *req;
-	bool found = false;
+	struct blk_mq_tag_set *tag_set = &ubbd_q->ubbd_dev->tag_set;
+	u32 hctx_idx = UBBD_REQ_TID_HCTX(req_tid);
+	struct ubbd_request *ubbd_req;
+	struct request *req;
 
-	list_for_each_entry(req, &ubbd_q->inflight_reqs, inflight_reqs_node) {
-		if (req->req_tid == req_tid) {
-			list_del_init(&req->inflight_reqs_node);
-			if (unlikely(atomic_read(&ubbd_q->status) == UBBD_QUEUE_KSTATUS_STOPPING) &&
-					list_empty(&ubbd_q->inflight_reqs)) {
-				atomic_set(&ubbd_q->status, UBBD_QUEUE_KSTATUS_STOPPED);
-			}
-			found = true;
-			break;
-		}
-	}
+	if (unlikely(!req_tid || hctx_idx >= tag_set->nr_hw_queues))
+		goto invalid;
+
+	req = blk_mq_tag_to_rq(tag_set->tags[hctx_idx], UBBD_REQ_TID_TAG(req_tid));
+	if (unlikely(!req))
+		goto invalid;
+
+	ubbd_req = blk_mq_rq_to_pdu(req);
+	if (unlikely(ubbd_req->ubbd_q != ubbd_q))
+		goto invalid;
 
-	if (found)
-		return req;
+	/* claim it, ubbd_queue_end_inflight_reqs() could race with us */
+	if (atomic64_cmpxchg(&ubbd_req->req_tid, req_tid, 0) != req_tid)
+		goto invalid;
+
+	ubbd_queue_inflight_dec(ubbd_q);
+
+	return ubbd_req;
+
+invalid:
+	ubbd_queue_debug(ubbd_q, "no inflight request for tid: %llu", req_tid);
 	return NULL;
 }
 
@@ -654,71 +1425,128 @@ static void ubbd_req_stats(struct ubbd_queue *ubbd_q, struct ubbd_request *ubbd_
 }
 #endif /* UBBD_REQUEST_STATS */
 
-static void complete_inflight_req(struct ubbd_queue *ubbd_q, struct ubbd_request *ubbd_req, int ret)
+/* everything but ending the request and advancing the cmd ring */
+static void ubbd_req_complete_prep(struct ubbd_queue *ubbd_q, struct ubbd_request *ubbd_req)
 {
 	ubbd_se_hdr_flags_set(ubbd_req->se, UBBD_SE_HDR_DONE);
+	if (ubbd_q->slots)
+		sbitmap_queue_clear(&ubbd_q->cmd_slots, ubbd_req->slot,
+				raw_smp_processor_id());
 	ubbd_req_release(ubbd_req);
 
 #ifdef UBBD_REQUEST_STATS
 	ubbd_req_stats_ktime_delta(ubbd_req->start_to_release, ubbd_req->start_kt);
 	ubbd_req_stats(ubbd_q, ubbd_req);
 #endif /* UBBD_REQUEST_STATS */
+}
+
+static void complete_inflight_req(struct ubbd_queue *ubbd_q, struct ubbd_request *ubbd_req, int ret)
+{
+	ubbd_req_complete_prep(ubbd_q, ubbd_req);
+
 	blk_mq_end_request(ubbd_req->req, errno_to_blk_status(ret));
 	spin_lock(&ubbd_q->cmdr_lock);
 	advance_cmd_ring(ubbd_q);
 	spin_unlock(&ubbd_q->cmdr_lock);
+
+	ubbd_queue_restart(ubbd_q);
 }
 
-void ubbd_queue_complete(struct ubbd_queue *ubbd_q)
+#ifdef HAVE_IO_COMP_BATCH
+static void ubbd_complete_batch(struct io_comp_batch *iob)
 {
+	/* requests are released before they are added to the batch */
+	blk_mq_end_request_batch(iob);
+}
+#endif /* HAVE_IO_COMP_BATCH */
+
+/*
+ * Drain all completion entries the backend has posted. The compr ring is
+ * consumed under one compr_lock hold with a single compr_tail update, the
+ * cmd ring is advanced once per sweep, and the requests are ended through
+ * the blk-mq batched completion API when iob is given.
+ *
+ * Returns the number of requests completed.
+ */
+#ifdef HAVE_IO_COMP_BATCH
+static int __ubbd_queue_complete(struct ubbd_queue *ubbd_q, struct io_comp_batch *iob)
+#else
+static int __ubbd_queue_complete(struct ubbd_queue *ubbd_q)
+#endif /* HAVE_IO_COMP_BATCH */
+{
+	struct ubbd_sb *sb = ubbd_q->sb_addr;
+	struct ubbd_request *ubbd_req, *next;
+	LIST_HEAD(done_list);
 	struct ubbd_ce *ce;
-	struct ubbd_request *ubbd_req;
-
-	/*
-	 * If queue is removing, return directly. This would happen
-	 * in force unmapping. inflight request would be ended by unmapping
-	 * */
-	if (atomic_read(&ubbd_q->status) == UBBD_QUEUE_KSTATUS_REMOVING) {
-		ubbd_queue_debug(ubbd_q, "is removing.");
-		return;
-	}
+	u32 tail, head;
+	int done = 0;
 
-again:
 	spin_lock(&ubbd_q->compr_lock);
-	ubbd_flush_dcache_range(ubbd_q->sb_addr, sizeof(*ubbd_q->sb_addr));
+	ubbd_queue_flush_sb(ubbd_q);
+
+	tail = *ubbd_q->sb_compr_tail;
+	head = smp_load_acquire(ubbd_q->sb_compr_head);
+	while (tail != head) {
+		ce = (struct ubbd_ce *)(ubbd_q->compr + tail);
+		ubbd_flush_dcache_range(ce, sizeof(*ce));
+
+		ubbd_req = fetch_inflight_req(ubbd_q, ce->priv_data);
+		if (ubbd_req) {
+			ubbd_req->result = ce->result;
+			list_add_tail(&ubbd_req->complete_node, &done_list);
+			done++;
+		}
 
-	ce = get_complete_entry(ubbd_q);
-	if (!ce) {
-		spin_unlock(&ubbd_q->compr_lock);
-		return;
+		tail = (tail + sizeof(struct ubbd_ce)) % sb->compr_size;
 	}
-	UPDATE_COMPR_TAIL(ubbd_q->sb_addr->compr_tail, sizeof(struct ubbd_ce), ubbd_q->sb_addr->compr_size);
+	smp_store_release(ubbd_q->sb_compr_tail, tail);
+	ubbd_q->completed += done;
 	spin_unlock(&ubbd_q->compr_lock);
 
-	ubbd_flush_dcache_range(ce, sizeof(*ce));
+	if (!done)
+		return 0;
+
+	list_for_each_entry(ubbd_req, &done_list, complete_node) {
+		ubbd_req_stats_ktime_delta(ubbd_req->start_to_complete, ubbd_req->start_kt);
 
-	spin_lock(&ubbd_q->inflight_reqs_lock);
-	ubbd_req = fetch_inflight_req(ubbd_q, ce->priv_data);
-	spin_unlock(&ubbd_q->inflight_reqs_lock);
-	if (!ubbd_req) {
-		goto again;
+		if (req_op(ubbd_req->req) == REQ_OP_READ) {
+			if (test_bit(UBBD_REQ_FLAGS_INLINE_DATA, &ubbd_req->flags))
+				copy_inline_data(ubbd_req, false);
+			else if (!test_bit(UBBD_REQ_FLAGS_ZEROCOPY, &ubbd_req->flags))
+				copy_data_from_ubbdreq(ubbd_req);
+		}
 	}
 
-	ubbd_req_stats_ktime_delta(ubbd_req->start_to_complete, ubbd_req->start_kt);
+	if (ubbd_dev_zerocopy(ubbd_q->ubbd_dev))
+		ubbd_queue_release_zc(ubbd_q, &done_list);
 
-	if (req_op(ubbd_req->req) == REQ_OP_READ)
-		copy_data_from_ubbdreq(ubbd_req);
+	list_for_each_entry(ubbd_req, &done_list, complete_node)
+		ubbd_req_complete_prep(ubbd_q, ubbd_req);
 
-	complete_inflight_req(ubbd_q, ubbd_req, ce->result);
+	spin_lock(&ubbd_q->cmdr_lock);
+	advance_cmd_ring(ubbd_q);
+	spin_unlock(&ubbd_q->cmdr_lock);
+
+	ubbd_queue_restart(ubbd_q);
+
+	list_for_each_entry_safe(ubbd_req, next, &done_list, complete_node) {
+#ifdef HAVE_IO_COMP_BATCH
+		if (blk_mq_add_to_batch(ubbd_req->req, iob, ubbd_req->result,
+					ubbd_complete_batch))
+			continue;
+#endif /* HAVE_IO_COMP_BATCH */
+		blk_mq_end_request(ubbd_req->req, errno_to_blk_status(ubbd_req->result));
+	}
 
-	goto again;
+	return done;
 }
 
-void complete_work_fn(struct work_struct *work)
+int ubbd_queue_complete(struct ubbd_queue *ubbd_q)
 {
-	struct ubbd_queue *ubbd_q = container_of(work, struct ubbd_queue, complete_work);
-	struct ubbd_ce *ce;
-	struct ubbd_request *ubbd_req;
+#ifdef HAVE_IO_COMP_BATCH
+	DEFINE_IO_COMP_BATCH(iob);
+#endif /* HAVE_IO_COMP_BATCH */
+	int done = 0, ret;
 
 	/*
 	 * If queue is removing, return directly. This would happen
@@ -726,57 +1554,211 @@ void complete_work_fn(struct work_struct *work)
 	 * */
 	if (atomic_read(&ubbd_q->status) == UBBD_QUEUE_KSTATUS_REMOVING) {
 		ubbd_queue_debug(ubbd_q, "is removing.");
-		return;
+		return 0;
 	}
 
-again:
-	spin_lock(&ubbd_q->compr_lock);
-	ubbd_flush_dcache_range(ubbd_q->sb_addr, sizeof(*ubbd_q->sb_addr));
+#ifdef HAVE_IO_COMP_BATCH
+	while ((ret = __ubbd_queue_complete(ubbd_q, &iob)))
+		done += ret;
 
-	ce = get_complete_entry(ubbd_q);
-	if (!ce) {
-		spin_unlock(&ubbd_q->compr_lock);
-		return;
-	}
-	UPDATE_COMPR_TAIL(ubbd_q->sb_addr->compr_tail, sizeof(struct ubbd_ce), ubbd_q->sb_addr->compr_size);
-	spin_unlock(&ubbd_q->compr_lock);
+	if (iob.complete)
+		iob.complete(&iob);
+#else
+	while ((ret = __ubbd_queue_complete(ubbd_q)))
+		done += ret;
+#endif /* HAVE_IO_COMP_BATCH */
 
-	ubbd_flush_dcache_range(ce, sizeof(*ce));
+	return done;
+}
 
-	spin_lock(&ubbd_q->inflight_reqs_lock);
-	ubbd_req = fetch_inflight_req(ubbd_q, ce->priv_data);
-	spin_unlock(&ubbd_q->inflight_reqs_lock);
-	if (!ubbd_req) {
-		goto again;
+#ifdef HAVE_IO_COMP_BATCH
+static int ubbd_queue_poll(struct ubbd_queue *ubbd_q, struct io_comp_batch *iob)
+{
+	if (unlikely(atomic_read(&ubbd_q->status) == UBBD_QUEUE_KSTATUS_REMOVING))
+		return 0;
+
+	return __ubbd_queue_complete(ubbd_q, iob);
+}
+
+int ubbd_poll(struct blk_mq_hw_ctx *hctx, struct io_comp_batch *iob)
+{
+	struct ubbd_queue *ubbd_q = hctx->driver_data;
+	struct ubbd_queue *hctx_q = &ubbd_q->ubbd_dev->queues[hctx->queue_num];
+	int done;
+
+	done = ubbd_queue_poll(ubbd_q, iob);
+	/* a stopped queue lends its hctx to another one, reap what it has left */
+	if (hctx_q != ubbd_q)
+		done += ubbd_queue_poll(hctx_q, iob);
+
+	return done;
+}
+
+#ifdef HAVE_MAP_QUEUES_VOID
+void ubbd_map_queues(struct blk_mq_tag_set *set)
+#else
+int ubbd_map_queues(struct blk_mq_tag_set *set)
+#endif /* HAVE_MAP_QUEUES_VOID */
+{
+	struct ubbd_device *ubbd_dev = set->driver_data;
+	unsigned int qoff = 0;
+	int i;
+
+	for (i = 0; i < set->nr_maps; i++) {
+		struct blk_mq_queue_map *map = &set->map[i];
+
+		if (i == HCTX_TYPE_DEFAULT)
+			map->nr_queues = ubbd_dev->num_queues - ubbd_dev->num_poll_queues;
+		else if (i == HCTX_TYPE_POLL)
+			map->nr_queues = ubbd_dev->num_poll_queues;
+		else
+			map->nr_queues = 0;
+
+		if (!map->nr_queues)
+			continue;
+
+		map->queue_offset = qoff;
+		qoff += map->nr_queues;
+		blk_mq_map_queues(map);
 	}
+#ifndef HAVE_MAP_QUEUES_VOID
+	return 0;
+#endif /* HAVE_MAP_QUEUES_VOID */
+}
+#endif /* HAVE_IO_COMP_BATCH */
 
-	ubbd_req_stats_ktime_delta(ubbd_req->start_to_complete, ubbd_req->start_kt);
+void complete_work_fn(struct work_struct *work)
+{
+	struct ubbd_queue *ubbd_q = container_of(work, struct ubbd_queue, complete_work);
 
-	if (req_op(ubbd_req->req) == REQ_OP_READ)
-		copy_data_from_ubbdreq(ubbd_req);
+	ubbd_queue_complete(ubbd_q);
+}
 
-	complete_inflight_req(ubbd_q, ubbd_req, ce->result);
+static bool ubbd_queue_compr_empty(struct ubbd_queue *ubbd_q)
+{
+	return (READ_ONCE(*ubbd_q->sb_compr_head) == *ubbd_q->sb_compr_tail);
+}
 
-	goto again;
+/*
+ * Reap completions, then keep polling compr_head for complete_poll_us
+ * before going to sleep. UBBD_SB_EXT_KF_NEED_WAKEUP is cleared while we
+ * are awake, so a busy backend never needs to write() to the kring.
+ */
+int ubbd_complete_thread_fn(void *data)
+{
+	struct ubbd_queue *ubbd_q = data;
+	struct ubbd_sb_ext *sb_ext = ubbd_q->sb_ext;
+	u64 poll_ns = (u64)ubbd_q->ubbd_dev->complete_poll_us * NSEC_PER_USEC;
+	u64 idle_start;
+
+	WRITE_ONCE(sb_ext->kflags, sb_ext->kflags & ~UBBD_SB_EXT_KF_NEED_WAKEUP);
+	idle_start = ktime_get_ns();
+
+	while (!kthread_should_stop()) {
+		clear_bit(UBBD_QUEUE_FLAGS_COMPLETE_PENDING, &ubbd_q->flags);
+		if (ubbd_queue_complete(ubbd_q)) {
+			idle_start = ktime_get_ns();
+			cond_resched();
+			continue;
+		}
+
+		if (ktime_get_ns() - idle_start < poll_ns) {
+			cond_resched();
+			cpu_relax();
+			continue;
+		}
+
+		WRITE_ONCE(sb_ext->kflags, sb_ext->kflags | UBBD_SB_EXT_KF_NEED_WAKEUP);
+		/*
+		 * set_current_state() implies a full barrier, pairing with the
+		 * one the backend has between its store to compr_head and the
+		 * load of kflags: either it sees NEED_WAKEUP or we see its CE.
+		 */
+		set_current_state(TASK_INTERRUPTIBLE);
+		if ((ubbd_queue_compr_empty(ubbd_q) ||
+				atomic_read(&ubbd_q->status) == UBBD_QUEUE_KSTATUS_REMOVING) &&
+				!test_bit(UBBD_QUEUE_FLAGS_COMPLETE_PENDING, &ubbd_q->flags) &&
+				!kthread_should_stop())
+			schedule();
+		__set_current_state(TASK_RUNNING);
+
+		WRITE_ONCE(sb_ext->kflags, sb_ext->kflags & ~UBBD_SB_EXT_KF_NEED_WAKEUP);
+		idle_start = ktime_get_ns();
+	}
+	WRITE_ONCE(sb_ext->kflags, sb_ext->kflags | UBBD_SB_EXT_KF_NEED_WAKEUP);
+
+	return 0;
 }
 
-void ubbd_queue_end_inflight_reqs(struct ubbd_queue *ubbd_q, int ret)
+/*
+ * The backend posted completions, run ubbd_queue_complete() in the
+ * context chosen for this device at ADD_DEV time.
+ */
+void ubbd_queue_kick_complete(struct ubbd_queue *ubbd_q)
 {
-	LIST_HEAD(tmp_list);
-	struct ubbd_request *req;
+	int cpu;
 
-	spin_lock(&ubbd_q->inflight_reqs_lock);
-	list_splice_init(&ubbd_q->inflight_reqs, &tmp_list);
-	spin_unlock(&ubbd_q->inflight_reqs_lock);
+	/* completions of poll queues are reaped by ubbd_poll() */
+	if (ubbd_queue_is_poll(ubbd_q))
+		return;
 
-	while (!list_empty(&tmp_list)) {
-		req = list_first_entry(&tmp_list,
-				struct ubbd_request, inflight_reqs_node);
-		list_del_init(&req->inflight_reqs_node);
-		complete_inflight_req(ubbd_q, req, ret);
+	switch (ubbd_q->ubbd_dev->complete_ctx) {
+	case UBBD_COMPLETE_CTX_KTHREAD:
+		set_bit(UBBD_QUEUE_FLAGS_COMPLETE_PENDING, &ubbd_q->flags);
+		wake_up_process(ubbd_q->complete_thread);
+		break;
+	case UBBD_COMPLETE_CTX_SUBMIT_CPU:
+		cpu = READ_ONCE(ubbd_q->submit_cpu);
+		if (cpu_online(cpu))
+			queue_work_on(cpu, ubbd_wq, &ubbd_q->complete_work);
+		else
+			queue_work(ubbd_wq, &ubbd_q->complete_work);
+		break;
+	default:
+		ubbd_queue_complete(ubbd_q);
+		break;
 	}
 }
 
+struct ubbd_end_inflight_data {
+	struct ubbd_queue	*ubbd_q;
+	int			ret;
+};
+
+#ifdef HAVE_BUSY_ITER_RESERVED
+static bool ubbd_end_inflight_req(struct request *req, void *data, bool reserved)
+#else
+static bool ubbd_end_inflight_req(struct request *req, void *data)
+#endif /* HAVE_BUSY_ITER_RESERVED */
+{
+	struct ubbd_end_inflight_data *end_data = data;
+	struct ubbd_queue *ubbd_q = end_data->ubbd_q;
+	struct ubbd_request *ubbd_req = blk_mq_rq_to_pdu(req);
+
+	if (ubbd_req->ubbd_q != ubbd_q)
+		return true;
+
+	/* not submitted to the cmd ring, or already claimed by a completion */
+	if (!atomic64_xchg(&ubbd_req->req_tid, 0))
+		return true;
+
+	ubbd_queue_inflight_dec(ubbd_q);
+	complete_inflight_req(ubbd_q, ubbd_req, end_data->ret);
+
+	return true;
+}
+
+void ubbd_queue_end_inflight_reqs(struct ubbd_queue *ubbd_q, int ret)
+{
+	struct ubbd_end_inflight_data end_data = {
+		.ubbd_q = ubbd_q,
+		.ret = ret,
+	};
+
+	blk_mq_tagset_busy_iter(&ubbd_q->ubbd_dev->tag_set,
+			ubbd_end_inflight_req, &end_data);
+}
+
 void ubbd_end_inflight_reqs(struct ubbd_device *ubbd_dev, int ret)
 {
 	int i;